@@ -0,0 +1,363 @@
+/* Benchmark driver of "make bench": runs every ROM of a directory headlessly
+* with the same seed and input each time, reports the speed of each one and
+* compares it with a stored baseline.
+*/
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "chip8.h"
+#include "chip8_sched.h"
+#include "chip8_lib.h"
+
+#define BENCH_SEED 1
+#define DEFAULT_FRAMES 500000
+#define DEFAULT_REPEAT 5
+#define DEFAULT_THRESHOLD 10.0
+
+/* Fixed input: every KEY_PERIOD frames the next key is held for KEY_HOLD frames */
+#define KEY_PERIOD 30
+#define KEY_HOLD 10
+
+#define NAME_SIZE 256
+
+typedef struct {
+  char name[NAME_SIZE];
+  uint64_t instructions;
+  uint64_t frames;
+  uint64_t draws;
+  double secs;            /* Best of the timed runs */
+  long max_rss_kb;
+  int status;
+} bench_result;
+
+static chip8_engine engine = run_switch;
+static const char *engine_name = "switch";
+static uint64_t max_frames = DEFAULT_FRAMES;
+static uint32_t ipf = DEFAULT_IPF;
+static int repeat = DEFAULT_REPEAT;
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options] rom_dir\n", prog);
+  printf("  --engine NAME    switch (default), cached or jit\n");
+  printf("  --frames N       frames run per ROM (default: %d)\n", DEFAULT_FRAMES);
+  printf("  --ipf N          instructions per frame (default: %d)\n", DEFAULT_IPF);
+  printf("  --repeat N       timed runs per ROM, the fastest counts (default: %d)\n", DEFAULT_REPEAT);
+  printf("  --json FILE      write the results as JSON\n");
+  printf("  --baseline FILE  compare with the JSON of an earlier run\n");
+  printf("  --threshold PCT  fail when a ROM is this much slower than the baseline\n");
+  printf("                   (default: %.0f)\n", DEFAULT_THRESHOLD);
+  exit(10);
+}
+
+static double elapsed_sec(const struct timespec *start, const struct timespec *end) {
+  return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void set_input(chip8_t *c8, uint64_t frame) {
+  memset(c8->keys, 0, sizeof(c8->keys));
+  if(frame % KEY_PERIOD < KEY_HOLD)
+    c8->keys[(frame / KEY_PERIOD) % 16] = true;
+}
+
+/* Count the sprites drawn over the run, one instruction at a time. It is
+* not timed: with the same seed and input every engine draws the same ones.
+*/
+static uint64_t count_draws(const chip8_t *boot) {
+  chip8_t *c8 = malloc(sizeof(chip8_t));
+  uint64_t draws = 0;
+
+  memcpy(c8, boot, sizeof(chip8_t));
+
+  for(uint64_t frame=0; frame<max_frames; frame++) {
+    int status = CHIP8_OK;
+
+    set_input(c8, frame);
+    for(uint32_t i=0; i<ipf && status == CHIP8_OK; i++) {
+      uint16_t pc = c8->cpu.pc & MEM_MASK;
+
+      if((c8->memory[pc] & 0xF0) == 0xD0)
+        draws++;
+      status = emulate_cycle(c8);
+    }
+
+    if(status != CHIP8_OK)
+      break;
+    tick_timers(c8);
+  }
+
+  free(c8);
+
+  return draws;
+}
+
+static int timed_run(const chip8_t *boot, bench_result *r) {
+  chip8_t *c8 = malloc(sizeof(chip8_t));
+  struct timespec start, end;
+  int status = CHIP8_OK;
+  uint64_t frame, instructions = 0;
+  double secs;
+
+  memcpy(c8, boot, sizeof(chip8_t));
+
+  /* cycle_count is 32 bits and wraps on long runs, so add up each frame's */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(frame=0; frame<max_frames && status == CHIP8_OK; frame++) {
+    uint32_t before = c8->cpu.cycle_count;
+
+    set_input(c8, frame);
+    status = run_frame(c8, engine, ipf);
+    instructions += c8->cpu.cycle_count - before;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  secs = elapsed_sec(&start, &end);
+  if(r->secs == 0 || secs < r->secs)
+    r->secs = secs;
+  r->instructions = instructions;
+  r->frames = frame;
+
+  free_jit(c8);
+  free(c8);
+
+  return status;
+}
+
+/* Runs in a child process of its own, so its peak RSS is the ROM's alone */
+static void bench_rom(const char *path, bench_result *r) {
+  chip8_t *boot = calloc(1, sizeof(chip8_t));
+  mapped_file image;
+  bool ok;
+
+  r->status = CHIP8_OK;
+
+  if(!map_file(path, &image)) {
+    r->status = -1;
+    return;
+  }
+
+  init_chip8(boot);
+  seed_chip8(boot, BENCH_SEED);
+  ok = copy_rom_image(boot, image.data, image.size);
+  unmap_file(&image);
+  if(!ok) {
+    r->status = -1;
+    return;
+  }
+
+  r->draws = count_draws(boot);
+  for(int i=0; i<repeat; i++)
+    r->status = timed_run(boot, r);
+
+  free(boot);
+}
+
+static bool run_child(const char *path, bench_result *r) {
+  struct rusage usage;
+  int fds[2], wstatus;
+  pid_t pid;
+
+  if(pipe(fds) != 0 || (pid = fork()) < 0)
+    return false;
+
+  if(pid == 0) {
+    close(fds[0]);
+    bench_rom(path, r);
+    if(write(fds[1], r, sizeof(*r)) != sizeof(*r))
+      _exit(1);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  if(read(fds[0], r, sizeof(*r)) != sizeof(*r))
+    r->status = -1;
+  close(fds[0]);
+
+  if(wait4(pid, &wstatus, 0, &usage) != pid || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+    return false;
+  r->max_rss_kb = usage.ru_maxrss;
+
+  return r->status >= 0;
+}
+
+static int by_name(const void *a, const void *b) {
+  return strcmp(((const bench_result *)a)->name, ((const bench_result *)b)->name);
+}
+
+static double per_sec(uint64_t n, double secs) {
+  return secs > 0 ? (double)n / secs : 0.0;
+}
+
+static bool write_json(const char *path, const bench_result *results, size_t n) {
+  FILE *fp;
+
+  if((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "%s: could not write results\n", path);
+    return false;
+  }
+
+  /* One ROM per line, which is what read_baseline() relies on */
+  fprintf(fp, "{\n  \"engine\": \"%s\",\n  \"frames\": %llu,\n  \"ipf\": %u,\n  \"seed\": %d,\n  \"roms\": [\n",
+          engine_name, (unsigned long long)max_frames, ipf, BENCH_SEED);
+  for(size_t i=0; i<n; i++) {
+    const bench_result *r = &results[i];
+
+    fprintf(fp, "    {\"rom\": \"%s\", \"instructions\": %llu, \"frames\": %llu, \"draws\": %llu, "
+            "\"seconds\": %.6f, \"ips\": %.0f, \"fps\": %.0f, \"draws_per_sec\": %.0f, "
+            "\"max_rss_kb\": %ld}%s\n",
+            r->name, (unsigned long long)r->instructions, (unsigned long long)r->frames,
+            (unsigned long long)r->draws, r->secs, per_sec(r->instructions, r->secs),
+            per_sec(r->frames, r->secs), per_sec(r->draws, r->secs), r->max_rss_kb,
+            i + 1 < n ? "," : "");
+  }
+  fprintf(fp, "  ]\n}\n");
+
+  return fclose(fp) == 0;
+}
+
+/* Instructions per second of rom in a file written by write_json(), 0 if absent */
+static double read_baseline(const char *path, const char *rom) {
+  char line[1024], name[NAME_SIZE];
+  double ips = 0;
+  FILE *fp;
+
+  if((fp = fopen(path, "r")) == NULL)
+    return 0;
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    const char *p = strstr(line, "\"ips\": ");
+
+    if(sscanf(line, " {\"rom\": \"%255[^\"]\"", name) == 1 && strcmp(name, rom) == 0 && p != NULL) {
+      ips = strtod(p + strlen("\"ips\": "), NULL);
+      break;
+    }
+  }
+
+  fclose(fp);
+
+  return ips;
+}
+
+int main(int argc, char *argv[]) {
+  const char *rom_dir = NULL, *json_file = NULL, *baseline = NULL;
+  double threshold = DEFAULT_THRESHOLD;
+  bench_result *results = NULL;
+  size_t n = 0, cap = 0;
+  int regressions = 0, failures = 0;
+  struct dirent *entry;
+  DIR *dir;
+
+  for(int i=1; i<argc; i++) {
+    if(strcmp(argv[i], "--engine") == 0 && i+1 < argc) {
+      engine_name = argv[++i];
+      if((engine = find_engine(engine_name)) == NULL)
+        usage(argv[0]);
+    }
+    else if(strcmp(argv[i], "--frames") == 0 && i+1 < argc)
+      max_frames = strtoull(argv[++i], NULL, 10);
+    else if(strcmp(argv[i], "--ipf") == 0 && i+1 < argc) {
+      if((ipf = (uint32_t)strtoul(argv[++i], NULL, 10)) == 0)
+        usage(argv[0]);
+    }
+    else if(strcmp(argv[i], "--repeat") == 0 && i+1 < argc) {
+      if((repeat = atoi(argv[++i])) <= 0)
+        usage(argv[0]);
+    }
+    else if(strcmp(argv[i], "--json") == 0 && i+1 < argc)
+      json_file = argv[++i];
+    else if(strcmp(argv[i], "--baseline") == 0 && i+1 < argc)
+      baseline = argv[++i];
+    else if(strcmp(argv[i], "--threshold") == 0 && i+1 < argc)
+      threshold = strtod(argv[++i], NULL);
+    else if(argv[i][0] != '-' && rom_dir == NULL)
+      rom_dir = argv[i];
+    else
+      usage(argv[0]);
+  }
+
+  if(rom_dir == NULL)
+    usage(argv[0]);
+
+  /* Every instruction counted must have been run, not skipped as an idle loop */
+  enable_idle_skip(false);
+
+  if((dir = opendir(rom_dir)) == NULL) {
+    fprintf(stderr, "%s: directory not found\n", rom_dir);
+    return 1;
+  }
+
+  while((entry = readdir(dir)) != NULL) {
+    char path[2 * NAME_SIZE];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", rom_dir, entry->d_name);
+    if(entry->d_name[0] == '.' || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    if(n == cap) {
+      cap = cap ? cap * 2 : 32;
+      results = realloc(results, cap * sizeof(bench_result));
+    }
+    memset(&results[n], 0, sizeof(bench_result));
+    snprintf(results[n].name, NAME_SIZE, "%s", entry->d_name);
+    n++;
+  }
+  closedir(dir);
+
+  qsort(results, n, sizeof(bench_result), by_name);
+
+  if(baseline != NULL && access(baseline, R_OK) != 0) {
+    printf("No baseline in %s yet, \"make bench-baseline\" stores one\n", baseline);
+    baseline = NULL;
+  }
+
+  printf("Engine: %s\tFrames: %llu\tIPF: %u\tSeed: %d\n",
+         engine_name, (unsigned long long)max_frames, ipf, BENCH_SEED);
+  printf("%-12s %14s %12s %12s %10s  %s\n", "ROM", "instr/s", "frames/s", "DXYN/s", "RSS kB", "vs baseline");
+
+  for(size_t i=0; i<n; i++) {
+    bench_result *r = &results[i];
+    char path[2 * NAME_SIZE];
+    double ips, base;
+
+    snprintf(path, sizeof(path), "%s/%s", rom_dir, r->name);
+    if(!run_child(path, r)) {
+      printf("%-12s failed\n", r->name);
+      failures++;
+      continue;
+    }
+
+    ips = per_sec(r->instructions, r->secs);
+    printf("%-12s %14.0f %12.0f %12.0f %10ld", r->name, ips, per_sec(r->frames, r->secs),
+           per_sec(r->draws, r->secs), r->max_rss_kb);
+
+    if(baseline != NULL && (base = read_baseline(baseline, r->name)) > 0) {
+      double change = 100.0 * (ips - base) / base;
+
+      printf("  %+6.1f%%", change);
+      if(change < -threshold) {
+        printf("  REGRESSION");
+        regressions++;
+      }
+    }
+    if(r->status != CHIP8_OK)
+      printf("  (stopped after %llu frames)", (unsigned long long)r->frames);
+    putchar('\n');
+  }
+
+  if(json_file != NULL && !write_json(json_file, results, n))
+    failures++;
+
+  if(regressions > 0)
+    printf("%d ROM(s) more than %.0f%% slower than the baseline\n", regressions, threshold);
+
+  free(results);
+
+  return regressions > 0 || failures > 0;
+}
@@ -2,12 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
 #include "chip8.h"
-
-CHIP8 cpu;
-uint8_t memory[MEM_SIZE];
-uint8_t gfx[SCREEN_WIDTH * SCREEN_HEIGHT];
-bool keys[16];
+#include "chip8_lib.h"
 
 uint8_t fontset[] = {0xF0, 0x90, 0x90, 0x90, 0xF0, /* 0 */
                     0x20, 0x60, 0x20, 0x20, 0x70, /* 1 */
@@ -33,81 +32,160 @@ uint8_t sprite_addr[] = {0x050, 0x055, 0x05A, 0x05F,
                         0x08C, 0x091, 0x096, 0x09B
 };
 
+/* SUPER-CHIP 8x10 digits of FX30, 0-9 and then A-F */
+uint8_t big_fontset[] = {0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, /* 0 */
+                        0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, /* 1 */
+                        0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, /* 2 */
+                        0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, /* 3 */
+                        0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, /* 4 */
+                        0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, /* 5 */
+                        0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, /* 6 */
+                        0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, /* 7 */
+                        0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, /* 8 */
+                        0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, /* 9 */
+                        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, /* A */
+                        0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, /* B */
+                        0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, /* C */
+                        0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, /* D */
+                        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, /* E */
+                        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  /* F */
+};
+
 /* Soft reset CHIP-8 function */
-void reset_chip8(void) {
-  memset(gfx, 0, sizeof(uint8_t) * SCREEN_WIDTH * SCREEN_HEIGHT);
-  cpu.pc = PRG_ADDR;
-  cpu.draw_flag = true;
+void reset_chip8(chip8_t *c8) {
+  c8->cpu.hires = false;
+  clear_screen(c8);
+  c8->cpu.pc = PRG_ADDR;
 }
 
 /* Initialize processor registers and memory */
-void init_chip8(void) {
-  memset(cpu.V, 0, sizeof(uint8_t) * 16);															/* Reset general-purpose registers to 0 */
-  memset(cpu.stack, 0, sizeof(uint16_t) * 16);												/* Reset stack to 0 										*/
-  memset(memory, 0, MEM_SIZE * sizeof(uint8_t));											/* Reset CHIP-8 memory to 0 						*/
-  memset(keys, 0, sizeof(bool) * 16);																	/* Reset keys													  */
-  memcpy(memory + 0x50, fontset, sizeof(fontset)/sizeof(*fontset));		/* Copy fontset to memory 						  */
-
-  cpu.cycle_count = 0;
-  cpu.I 	= cpu.opcode = cpu.sp = 0;
-  cpu.delay_timer = cpu.sound_timer = 0;
-
-  reset_chip8();
+void init_chip8(chip8_t *c8) {
+  memset(c8->cpu.V, 0, sizeof(uint8_t) * 16);															/* Reset general-purpose registers to 0 */
+  memset(c8->cpu.stack, 0, sizeof(uint16_t) * 16);												/* Reset stack to 0 										*/
+  memset(c8->memory, 0, MEM_SIZE * sizeof(uint8_t));											/* Reset CHIP-8 memory to 0 						*/
+  memset(c8->keys, 0, sizeof(bool) * 16);																	/* Reset keys													  */
+  memcpy(c8->memory + 0x50, fontset, sizeof(fontset)/sizeof(*fontset));		/* Copy fontset to memory 						  */
+  memcpy(c8->memory + BIG_FONT_ADDR, big_fontset, sizeof(big_fontset));	/* And the SUPER-CHIP one after it	  */
+  memset(c8->flags, 0, sizeof(c8->flags));																/* Reset RPL user flags									*/
+  invalidate_decoded(c8, 0, MEM_SIZE);																/* Forget decoded and translated code  */
+
+  c8->cpu.cycle_count = 0;
+  c8->cpu.I 	= c8->cpu.opcode = c8->cpu.sp = 0;
+  c8->cpu.delay_timer = c8->cpu.sound_timer = 0;
+  seed_chip8(c8, (uint32_t)time(NULL));
+
+  reset_chip8(c8);
 }
 
+/* Start the CXNN generator from seed, the same seed gives the same numbers */
+void seed_chip8(chip8_t *c8, uint32_t seed) {
+  /* Spread the bits of small seeds, xorshift can't leave 0 */
+  seed = (seed ^ (seed >> 16)) * 0x45D9F3B;
+  seed ^= seed >> 16;
+  c8->cpu.rng = seed ? seed : 1;
+}
 
-/* Get file size */
-long fsize(FILE *fp) {
-  long size;
-
-  fseek(fp, 0L, SEEK_END);
-  size = ftell(fp);
+/* xorshift32, keeping the high byte which mixes best */
+uint8_t random_byte(chip8_t *c8) {
+  uint32_t x = c8->cpu.rng;
 
-  rewind(fp);
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  c8->cpu.rng = x;
 
-  return size;
+  return x >> 24;
 }
 
-bool is_file(const char *filename) {
-  const char *pos_ponto = strstr(filename, ".c8");
 
-  if(pos_ponto == NULL)
-    return false;
-  if(pos_ponto == filename)
-    return false;
-  if(*(pos_ponto+1) == '\0')
+/* Copy a ROM already held in host memory, returns false if it doesn't fit */
+bool copy_rom_image(chip8_t *c8, const uint8_t *image, size_t size) {
+  if(size > FREE_MEM)
     return false;
 
+  memcpy(c8->memory + PRG_ADDR, image, size);
+  invalidate_decoded(c8, PRG_ADDR, size);
   return true;
 }
 
-void copy_to_memory(FILE *fp) {
-  size_t sz = (size_t)fsize(fp);
+/* Map the ROM file and copy it in, any file name will do */
+void load_rom(chip8_t *c8, const char *n_game) {
+  mapped_file rom;
+
+  if(!map_file(n_game, &rom))
+    exit(3);
 
-  if(sz <= FREE_MEM)
-    fread(memory + PRG_ADDR, sizeof(uint8_t), sz, fp);
-  else {
+  if(!copy_rom_image(c8, rom.data, rom.size)) {
     fprintf(stderr, "Game size exceeded free memory.\n");
     exit(1);
   }
-}
 
-void load_rom(const char *n_game) {
-  FILE *fp;
+  unmap_file(&rom);
+}
 
-  if(!is_file(n_game)) {
-    fprintf(stderr, "File name doesn't match the pattern: filename.c8\n");
-    exit(2);
+/* FNV-1a hash of the framebuffer, used to compare runs without dumping the screen.
+* Only the pixels of the current resolution count, so CHIP-8 hashes are unchanged.
+*/
+uint64_t hash_gfx(const chip8_t *c8) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  size_t rows = c8->cpu.hires ? HIRES_HEIGHT : SCREEN_HEIGHT, words = c8->cpu.hires ? ROW_WORDS : 1;
+
+  for(size_t i=0; i<rows; i++) {
+    for(size_t w=0; w<words; w++) {
+      for(int shift=56; shift>=0; shift-=8) {
+        hash ^= (c8->gfx[i][w] >> shift) & 0xFF;
+        hash *= 0x100000001B3ULL;
+      }
+    }
   }
 
-  if((fp = fopen(n_game, "rb")) == NULL) {
-    fprintf(stderr, "File not found\n");
-    exit(3);
+  return hash;
+}
+
+/* Expand one framebuffer row into 32-bit pixels, on for set bits and off for clear ones */
+static void expand_row(uint64_t row, uint32_t *out, uint32_t on, uint32_t off) {
+#ifdef __SSE2__
+  /* Four pixels at a time: spread a nibble over the lanes and compare each to its bit */
+  const __m128i bits = _mm_set_epi32(1, 2, 4, 8);
+  const __m128i v_on = _mm_set1_epi32((int)on), v_off = _mm_set1_epi32((int)off);
+
+  for(int i=0; i<SCREEN_WIDTH; i+=4) {
+    __m128i nibble = _mm_set1_epi32((int)(row >> (SCREEN_WIDTH - 4 - i)) & 0xF);
+    __m128i mask = _mm_cmpeq_epi32(_mm_and_si128(nibble, bits), bits);
+
+    _mm_storeu_si128((__m128i *)(out + i),
+                     _mm_or_si128(_mm_and_si128(mask, v_on), _mm_andnot_si128(mask, v_off)));
   }
+#else
+  for(int i=0; i<SCREEN_WIDTH; i++)
+    out[i] = (row >> (SCREEN_WIDTH - 1 - i)) & 1 ? on : off;
+#endif
+}
 
-  copy_to_memory(fp);
+/* Convert n_rows framebuffer rows from first_row on into width 32-bit pixels each,
+* width being SCREEN_WIDTH or HIRES_WIDTH
+*/
+void expand_gfx(const uint64_t (*gfx)[ROW_WORDS], uint32_t *pixels, int width, int first_row, int n_rows, uint32_t on, uint32_t off) {
+  for(int i=0; i<n_rows; i++)
+    for(int w=0; w<width / 64; w++)
+      expand_row(gfx[first_row + i][w], pixels + i * width + w * 64, on, off);
+}
 
-  fclose(fp);
+/* Explain on stderr why emulate_cycle() stopped the machine */
+void print_status(const chip8_t *c8, int status) {
+  switch(status) {
+    case CHIP8_OK:
+      break;
+    case CHIP8_BAD_OPCODE:
+      fprintf(stderr, "Unknown opcode 0x%04X at 0x%03X\n", c8->cpu.opcode, c8->cpu.pc);
+      break;
+    case CHIP8_BAD_STACK:
+      fprintf(stderr, "Stack %s at 0x%03X\n", c8->cpu.sp == 0 ? "underflow" : "overflow", c8->cpu.pc);
+      break;
+    case CHIP8_EXIT:
+      fprintf(stderr, "Program exited at 0x%03X\n", c8->cpu.pc);
+      break;
+  }
 }
 
 /* The interpreter reads N bytes from memory, starting at the address stored in I.
@@ -116,26 +194,126 @@ void load_rom(const char *n_game) {
 * VF is set to 1, otherwise it is set to 0.
 * If the sprite is positioned so part of it is outside the coordinates of the display,
 * it wraps around to the opposite side of the screen.
+* A height of 0 (SUPER-CHIP DXY0) draws a 16x16 sprite of two bytes per row, in
+* either resolution.
 */
-void draw_sprite(uint8_t x, uint8_t y, uint8_t height) {
-  uint8_t pixel;
+void draw_sprite(chip8_t *c8, uint8_t x, uint8_t y, uint8_t height) {
+  bool hires = c8->cpu.hires, wide = height == 0, collision = false;
+  unsigned rows = hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+  unsigned shift = x % (hires ? HIRES_WIDTH : SCREEN_WIDTH);
+
+  if(wide)
+    height = 16;
 
-  cpu.V[0xF] = 0;
   for(int yline=0; yline<height; yline++) {
-    pixel = memory[cpu.I + yline];
+    uint64_t *row = c8->gfx[(y + yline) % rows];
+    uint64_t pixels;
+
+    /* Sprite rows start out at the left edge */
+    if(wide)
+      pixels = (uint64_t)(c8->memory[(c8->cpu.I + 2 * yline) & MEM_MASK] << 8
+                          | c8->memory[(c8->cpu.I + 2 * yline + 1) & MEM_MASK]) << 48;
+    else
+      pixels = (uint64_t)c8->memory[(c8->cpu.I + yline) & MEM_MASK] << 56;
+
+    if(!hires) {
+      /* Rotating right wraps the sprite around the right edge of the screen */
+      pixels = (pixels >> shift) | (pixels << ((SCREEN_WIDTH - shift) & (SCREEN_WIDTH - 1)));
+      collision |= (row[0] & pixels) != 0;
+      row[0] ^= pixels;
+    } else {
+      /* The same rotation over the two words of a 128-pixel row */
+      uint64_t left = shift < 64 ? pixels : 0, right = shift < 64 ? 0 : pixels;
+      unsigned s = shift % 64;
+
+      if(s != 0) {
+        uint64_t l = (left >> s) | (right << (64 - s));
+
+        right = (right >> s) | (left << (64 - s));
+        left = l;
+      }
+      collision |= ((row[0] & left) | (row[1] & right)) != 0;
+      row[0] ^= left;
+      row[1] ^= right;
+    }
+    c8->dirty_rows |= (uint64_t)1 << ((y + yline) % rows);
+  }
 
-    for(int xline=0; xline<8; xline++) {
-      uint8_t posX = (x + xline) % SCREEN_WIDTH;
-      uint8_t posY = (y + yline) % SCREEN_HEIGHT;
-      uint16_t posPixel = (uint16_t)(posX + (posY * 64));
+  c8->cpu.V[0xF] = collision;
+}
 
-      if((pixel & (0x80 >> xline)) != 0) {
-        if(gfx[posPixel] == 1)
-          cpu.V[0xF] = 1;
-        gfx[posPixel] ^= 1;
-      }
+/* 00E0 and reset: blank the display, every row needs redrawing */
+void clear_screen(chip8_t *c8) {
+  memset(c8->gfx, 0, sizeof(c8->gfx));
+  c8->dirty_rows = ~(uint64_t)0;
+  c8->cpu.draw_flag = true;
+}
+
+/* Rows of the current resolution with something on them need redrawing when the
+* display scrolls, before and after it moves. Rows blank on both sides stay clean.
+*/
+static void mark_lit_rows(chip8_t *c8, unsigned rows) {
+  for(unsigned i=0; i<rows; i++)
+    if((c8->gfx[i][0] | c8->gfx[i][1]) != 0)
+      c8->dirty_rows |= (uint64_t)1 << i;
+  c8->cpu.draw_flag = true;
+}
+
+/* 00CN: scroll the display down n rows of the current resolution, whole rows are moved */
+void scroll_down(chip8_t *c8, uint8_t n) {
+  unsigned rows = c8->cpu.hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+
+  if(n >= rows)
+    n = (uint8_t)rows;
+
+  mark_lit_rows(c8, rows);
+  memmove(c8->gfx[n], c8->gfx[0], (rows - n) * sizeof(c8->gfx[0]));
+  memset(c8->gfx[0], 0, n * sizeof(c8->gfx[0]));
+  mark_lit_rows(c8, rows);
+}
+
+/* 00FB: scroll the display 4 pixels right, a shift of each row's words */
+void scroll_right(chip8_t *c8) {
+  unsigned rows = c8->cpu.hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+
+  mark_lit_rows(c8, rows);
+  for(unsigned i=0; i<rows; i++) {
+    if(c8->cpu.hires)
+      c8->gfx[i][1] = (c8->gfx[i][1] >> 4) | (c8->gfx[i][0] << 60);
+    c8->gfx[i][0] >>= 4;
+  }
+  mark_lit_rows(c8, rows);
+}
+
+/* 00FC: scroll the display 4 pixels left */
+void scroll_left(chip8_t *c8) {
+  unsigned rows = c8->cpu.hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+
+  mark_lit_rows(c8, rows);
+  for(unsigned i=0; i<rows; i++) {
+    c8->gfx[i][0] <<= 4;
+    if(c8->cpu.hires) {
+      c8->gfx[i][0] |= c8->gfx[i][1] >> 60;
+      c8->gfx[i][1] <<= 4;
     }
   }
+  mark_lit_rows(c8, rows);
+}
+
+/* 00FE and 00FF: switch resolution, which blanks the display */
+void set_hires(chip8_t *c8, bool on) {
+  c8->cpu.hires = on;
+  clear_screen(c8);
+}
+
+/* Forget the pre-decoded and translated instructions overlapping len bytes written at addr.
+* An instruction starting one byte before addr also reads the first byte.
+*/
+void invalidate_decoded(chip8_t *c8, uint16_t addr, size_t len) {
+  for(size_t i=0; i<=len; i++)
+    c8->decoded[(addr + i - 1) & MEM_MASK].op = OP_DECODE;
+
+  jit_invalidate(c8, addr, len);
 }
 
 /* Opcode symbols:
@@ -149,176 +327,209 @@ void draw_sprite(uint8_t x, uint8_t y, uint8_t height) {
 * VN     : One of the 16 available variables. N may be 0 to F (hexadecimal)
 */
 
-/* Emulate CPU cycle: fetch, decode, execute */
-void emulate_cycle(void) {
+/* Emulate CPU cycle: fetch, decode, execute.
+* Returns CHIP8_OK, or the reason the machine cannot continue.
+*/
+int emulate_cycle(chip8_t *c8) {
   /* Fetch opcode */
-  cpu.opcode = memory[cpu.pc] << 8 | memory[cpu.pc + 1];
+  c8->cpu.opcode = c8->memory[c8->cpu.pc & MEM_MASK] << 8 | c8->memory[(c8->cpu.pc + 1) & MEM_MASK];
+  c8->cpu.cycle_count++;
 
   /* Decode and execute opcode */
-  switch(cpu.opcode & 0xF000) {
+  switch(c8->cpu.opcode & 0xF000) {
     case 0x0000:
-      switch(cpu.opcode & 0x00FF) {
+      switch(c8->cpu.opcode & 0x00FF) {
         case 0x00E0:
           /* 00E0: Clears the screen */
-          memset(gfx, 0, SCREEN_WIDTH * SCREEN_HEIGHT);
-          cpu.draw_flag = true;
-          cpu.pc += 2;
+          clear_screen(c8);
+          c8->cpu.pc += 2;
           break;
         case 0x00EE:
           /* 00EE: Returns from a subroutine. */
-          cpu.sp--;
-          cpu.pc = cpu.stack[cpu.sp];
-          cpu.pc += 2;
+          if(c8->cpu.sp == 0)
+            return CHIP8_BAD_STACK;
+          c8->cpu.sp--;
+          c8->cpu.pc = c8->cpu.stack[c8->cpu.sp];
+          c8->cpu.pc += 2;
+          break;
+        case 0x00FB:
+          /* 00FB: Scrolls the display right by 4 pixels. (SUPER-CHIP) */
+          scroll_right(c8);
+          c8->cpu.pc += 2;
+          break;
+        case 0x00FC:
+          /* 00FC: Scrolls the display left by 4 pixels. (SUPER-CHIP) */
+          scroll_left(c8);
+          c8->cpu.pc += 2;
+          break;
+        case 0x00FD:
+          /* 00FD: Exits the interpreter. (SUPER-CHIP) */
+          return CHIP8_EXIT;
+        case 0x00FE:
+          /* 00FE: Switches to the 64x32 display. (SUPER-CHIP) */
+          set_hires(c8, false);
+          c8->cpu.pc += 2;
+          break;
+        case 0x00FF:
+          /* 00FF: Switches to the 128x64 display. (SUPER-CHIP) */
+          set_hires(c8, true);
+          c8->cpu.pc += 2;
           break;
         default:
-          fprintf(stderr, "Unknown opcode 0x%04X\n", cpu.opcode);
-          exit(4);
+          /* 00CN: Scrolls the display down by N rows. (SUPER-CHIP) */
+          if((c8->cpu.opcode & 0x00F0) == 0x00C0) {
+            scroll_down(c8, c8->cpu.opcode & 0x000F);
+            c8->cpu.pc += 2;
+            break;
+          }
+          return CHIP8_BAD_OPCODE;
       }
       break;
     case 0x1000:
       /* 1NNN: Jumps to address NNN. */
-      cpu.pc = cpu.opcode & 0x0FFF;
+      c8->cpu.pc = c8->cpu.opcode & 0x0FFF;
       break;
     case 0x2000:
       /* 2NNN: Calls subroutine at NNN. */
-      cpu.stack[cpu.sp] = cpu.pc;
-      cpu.sp++;
-      cpu.pc = cpu.opcode & 0x0FFF;
+      if(c8->cpu.sp == 16)
+        return CHIP8_BAD_STACK;
+      c8->cpu.stack[c8->cpu.sp] = c8->cpu.pc;
+      c8->cpu.sp++;
+      c8->cpu.pc = c8->cpu.opcode & 0x0FFF;
       break;
     case 0x3000:
       /* 3XNN: Skips the next instruction if VX equals to NN. */
-      cpu.pc += (cpu.V[(cpu.opcode & 0x0F00) >> 8] == (cpu.opcode & 0x00FF)) ? 4 : 2;
+      c8->cpu.pc += (c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] == (c8->cpu.opcode & 0x00FF)) ? 4 : 2;
       break;
     case 0x4000:
       /* 4XNN: Skips the next instruction if VX does not equal NN. */
-      cpu.pc += (cpu.V[(cpu.opcode & 0x0F00) >> 8] != (cpu.opcode & 0x00FF)) ? 4 : 2;
+      c8->cpu.pc += (c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] != (c8->cpu.opcode & 0x00FF)) ? 4 : 2;
       break;
     case 0x5000:
       /* 5XY0: Skips the next instruction if VX equals VY. */
-      cpu.pc += (cpu.V[(cpu.opcode & 0x0F00) >> 8] == cpu.V[(cpu.opcode & 0x00F0) >> 4]) ? 4 : 2;
+      c8->cpu.pc += (c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] == c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4]) ? 4 : 2;
       break;
     case 0x6000:
       /* 6XNN: Sets VX to NN */
-      cpu.V[(cpu.opcode & 0x0F00) >> 8] = cpu.opcode & 0x00FF;
-      cpu.pc += 2;
+      c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] = c8->cpu.opcode & 0x00FF;
+      c8->cpu.pc += 2;
       break;
     case 0x7000:
       /* 7XNN: Adds NN to VX. (Carry flag is not changed) */
-      cpu.V[(cpu.opcode & 0x0F00) >> 8] += cpu.opcode & 0x00FF;
-      cpu.pc += 2;
+      c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] += c8->cpu.opcode & 0x00FF;
+      c8->cpu.pc += 2;
       break;
     case 0x8000:
-      switch(cpu.opcode & 0x000F) {
+      switch(c8->cpu.opcode & 0x000F) {
         case 0x0000:
           /* 8XY0: Sets VX to the value of VY. */
-          cpu.V[(cpu.opcode & 0x0F00) >> 8] = cpu.V[(cpu.opcode & 0x00F0) >> 4];
-          cpu.pc += 2;
+          c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] = c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4];
+          c8->cpu.pc += 2;
           break;
         case 0x0001:
           /* 8XY1: Sets VX to VX or VY. (Bitwise OR operation) */
-          cpu.V[(cpu.opcode & 0x0F00) >> 8] |= cpu.V[(cpu.opcode & 0x00F0) >> 4];
-          cpu.pc += 2;
+          c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] |= c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4];
+          c8->cpu.pc += 2;
           break;
         case 0x0002:
           /* 8XY2: Sets VX to VX and VY. (Bitwise AND operation) */
-          cpu.V[(cpu.opcode & 0x0F00) >> 8] &= cpu.V[(cpu.opcode & 0x00F0) >> 4];
-          cpu.pc += 2;
+          c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] &= c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4];
+          c8->cpu.pc += 2;
           break;
         case 0x0003:
           /* 8XY3: Sets VX to VX xor VY. */
-          cpu.V[(cpu.opcode & 0x0F00) >> 8] ^= cpu.V[(cpu.opcode & 0x00F0) >> 4];
-          cpu.pc += 2;
+          c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] ^= c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4];
+          c8->cpu.pc += 2;
           break;
         case 0x0004:
           /* 8XY4: Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there is not. */
-          if(cpu.V[(cpu.opcode & 0x00F0) >> 4] > (0xFF - cpu.V[(cpu.opcode & 0x0F00) >> 8]))
-            cpu.V[0xF] = 1;
+          if(c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4] > (0xFF - c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8]))
+            c8->cpu.V[0xF] = 1;
           else
-            cpu.V[0xF] = 0;
-          cpu.V[(cpu.opcode & 0x0F00) >> 8] += cpu.V[(cpu.opcode & 0x00F0) >> 4];
-          cpu.pc += 2;
+            c8->cpu.V[0xF] = 0;
+          c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] += c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4];
+          c8->cpu.pc += 2;
           break;
         case 0x0005:
           /* 8XY5: VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there is not. */
-          if(cpu.V[(cpu.opcode & 0x0F00) >> 8] > cpu.V[(cpu.opcode & 0x00F0) >> 4])
-            cpu.V[0xF] = 1;
+          if(c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] > c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4])
+            c8->cpu.V[0xF] = 1;
           else
-            cpu.V[0xF] = 0;
-          cpu.V[(cpu.opcode & 0x0F00) >> 8] -= cpu.V[(cpu.opcode & 0x00F0) >> 4];
-          cpu.pc += 2;
+            c8->cpu.V[0xF] = 0;
+          c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] -= c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4];
+          c8->cpu.pc += 2;
           break;
         case 0x0006:
           /* 8XY6: If the least-significant bit of VX is 1, then VF is set to 1, otherwise 0. Then Vx is divided by 2. */
-          cpu.V[0xF] = cpu.V[(cpu.opcode & 0x0F00) >> 8] & 0x1;
-          cpu.V[(cpu.opcode & 0x0F00) >> 8] >>= 1;
-          cpu.pc += 2;
+          c8->cpu.V[0xF] = c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] & 0x1;
+          c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] >>= 1;
+          c8->cpu.pc += 2;
           break;
         case 0x0007:
           /* 8XY7: Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there is not. */
-          if(cpu.V[(cpu.opcode & 0x0F00) >> 8] > cpu.V[(cpu.opcode & 0x00F0) >> 4])
-            cpu.V[0xF] = 0;
+          if(c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] > c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4])
+            c8->cpu.V[0xF] = 0;
           else
-            cpu.V[0xF] = 1;
-          cpu.V[(cpu.opcode & 0x0F00) >> 8] = cpu.V[(cpu.opcode & 0x00F0) >> 4] - cpu.V[(cpu.opcode & 0x0F00) >> 8];
-          cpu.pc += 2;
+            c8->cpu.V[0xF] = 1;
+          c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] = c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4] - c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8];
+          c8->cpu.pc += 2;
           break;
         case 0x000E:
           /* 8XYE: If the most-significant bit of Vx is 1, then VF is set to 1, otherwise to 0. Then Vx is multiplied by 2. */
-          cpu.V[0xF] = cpu.V[(cpu.opcode & 0x0F00) >> 8] >> 7;
-          cpu.V[(cpu.opcode & 0x0F00) >> 8] <<= 1;
-          cpu.pc += 2;
+          c8->cpu.V[0xF] = c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] >> 7;
+          c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] <<= 1;
+          c8->cpu.pc += 2;
           break;
         default:
-          fprintf(stderr, "Unknown opcode 0x%04X\n", cpu.opcode);
-          exit(4);
+          return CHIP8_BAD_OPCODE;
       }
       break;
     case 0x9000:
       /* 9XY0: Skips the next instruction if VX does not equal VY. */
-      cpu.pc += (cpu.V[(cpu.opcode & 0x0F00) >> 8] != cpu.V[(cpu.opcode & 0x00F0) >> 4]) ? 4 : 2;
+      c8->cpu.pc += (c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] != c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4]) ? 4 : 2;
       break;
     case 0xA000:
       /* ANNN: Sets I (address register) to the address NNN */
-      cpu.I = cpu.opcode & 0x0FFF;
-      cpu.pc += 2;
+      c8->cpu.I = c8->cpu.opcode & 0x0FFF;
+      c8->cpu.pc += 2;
       break;
     case 0xB000:
       /* BNNN: Jumps to the address NNN plus V0. */
-      cpu.pc = cpu.V[0x0] + (cpu.opcode & 0x0FFF);
+      c8->cpu.pc = c8->cpu.V[0x0] + (c8->cpu.opcode & 0x0FFF);
       break;
     case 0xC000:
       /* CXNN: Sets VX to the result of a bitwise and operation on a random number and NN.  */
-      srand((unsigned int)time(NULL));
-      cpu.V[(cpu.opcode & 0x0F00) >> 8] = (rand() % 0xFF) & (cpu.opcode & 0x00FF);
-      cpu.pc += 2;
+      c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] = random_byte(c8) & (c8->cpu.opcode & 0x00FF);
+      c8->cpu.pc += 2;
       break;
     case 0xD000:
-      /* DXYN: Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels and a height of N pixels. */
-      draw_sprite(cpu.V[(cpu.opcode & 0x0F00) >> 8], cpu.V[(cpu.opcode & 0x00F0) >> 4], cpu.opcode & 0x000F);
-      cpu.draw_flag = true;
-      cpu.pc += 2;
+      /* DXYN: Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels and a height of N pixels.
+      * DXY0 draws a 16x16 sprite. (SUPER-CHIP)
+      */
+      draw_sprite(c8, c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8], c8->cpu.V[(c8->cpu.opcode & 0x00F0) >> 4], c8->cpu.opcode & 0x000F);
+      c8->cpu.draw_flag = true;
+      c8->cpu.pc += 2;
       break;
     case 0xE000:
-      switch(cpu.opcode & 0x00FF) {
+      switch(c8->cpu.opcode & 0x00FF) {
         case 0x009E:
           /* EX9E: Skips the next instruction if the key stored in VX is pressed. */
-          cpu.pc += (keys[cpu.V[(cpu.opcode & 0x0F00) >> 8]] == true) ? 4 : 2;
+          c8->cpu.pc += (c8->keys[c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] & 0xF] == true) ? 4 : 2;
           break;
         case 0x00A1:
           /* EXA1: Skips the next instruction if the key stored in VX is not pressed. */
-          cpu.pc += (keys[cpu.V[(cpu.opcode & 0x0F00) >> 8]] == false) ? 4 : 2;
+          c8->cpu.pc += (c8->keys[c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] & 0xF] == false) ? 4 : 2;
           break;
         default:
-          fprintf(stderr, "Unknown opcode 0x%04X\n", cpu.opcode);
-          exit(4);
+          return CHIP8_BAD_OPCODE;
       }
       break;
     case 0xF000:
-      switch(cpu.opcode & 0x00FF) {
+      switch(c8->cpu.opcode & 0x00FF) {
         case 0x0007:
           /* FX07: Sets VX to the value of the delay timer. */
-          cpu.V[(cpu.opcode & 0x0F00) >> 8] = cpu.delay_timer;
-          cpu.pc += 2;
+          c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] = c8->cpu.delay_timer;
+          c8->cpu.pc += 2;
           break;
         case 0x000A: {
           /* FX0A: A key press is awaited, and then stored in VX. (Blocking Operation.
@@ -327,27 +538,25 @@ void emulate_cycle(void) {
             bool key_press = false;
 
             for(uint8_t i=0; i<16; i++) {
-              if(keys[i] != false) {
-                cpu.V[(cpu.opcode & 0x0F00) >> 8] = i;
+              if(c8->keys[i] != false) {
+                c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] = i;
                 key_press = true;
               }
             }
 
-            if(!key_press)
-              return;
-
-            cpu.pc += 2;
+            if(key_press)
+              c8->cpu.pc += 2;
           }
           break;
         case 0x0015:
           /* FX15: Sets the delay timer to VX. */
-          cpu.delay_timer = cpu.V[(cpu.opcode & 0x0F00) >> 8];
-          cpu.pc += 2;
+          c8->cpu.delay_timer = c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8];
+          c8->cpu.pc += 2;
           break;
         case 0x0018:
           /* FX18: Sets the sound timer to VX. */
-          cpu.sound_timer = cpu.V[(cpu.opcode & 0x0F00) >> 8];
-          cpu.pc += 2;
+          c8->cpu.sound_timer = c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8];
+          c8->cpu.pc += 2;
           break;
         case 0x001E:
           /* FX1E: Adds VX to I.
@@ -356,63 +565,123 @@ void emulate_cycle(void) {
           * and to 0 when there is not.[15] The only known game that depends on this behavior is Spacefight 2091!
           * while at least one game, Animal Race, depends on VF not being affected.
           */
-          if(cpu.I + cpu.V[(cpu.opcode & 0x0F00) >> 8] > 0xFFF)
-            cpu.V[0xF] = 1;
+          if(c8->cpu.I + c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] > 0xFFF)
+            c8->cpu.V[0xF] = 1;
           else
-            cpu.V[0xF] = 0;
-          cpu.I += cpu.V[(cpu.opcode & 0x0F00) >> 8];
-          cpu.pc += 2;
+            c8->cpu.V[0xF] = 0;
+          c8->cpu.I += c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8];
+          c8->cpu.pc += 2;
           break;
         case 0x0029:
           /* FX29: Sets I to the location of the sprite for the character in VX.
           * Characters 0-F (in hexadecimal) are represented by a 4x5 font.
           */
-          cpu.I = sprite_addr[cpu.V[(cpu.opcode & 0x0F00) >> 8]];
-          cpu.pc += 2;
+          c8->cpu.I = sprite_addr[c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] & 0xF];
+          c8->cpu.pc += 2;
+          break;
+        case 0x0030:
+          /* FX30: Sets I to the 8x10 sprite of the digit in VX. (SUPER-CHIP) */
+          c8->cpu.I = BIG_FONT_ADDR + (c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] & 0xF) * 10;
+          c8->cpu.pc += 2;
           break;
         case 0x0033:
           /* FX33: Store BCD representation of X in memory locations I, I+1, and I+2. */
-          memory[cpu.I] 		= cpu.V[(cpu.opcode & 0x0F00) >> 8] / 100;
-          memory[cpu.I + 1] = cpu.V[(cpu.opcode & 0x0F00) >> 8] % 100 / 10;
-          memory[cpu.I + 2] = cpu.V[(cpu.opcode & 0x0F00) >> 8] % 100 % 10 / 1;
-          cpu.pc += 2;
+          c8->memory[c8->cpu.I & MEM_MASK]       = c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] / 100;
+          c8->memory[(c8->cpu.I + 1) & MEM_MASK] = c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] % 100 / 10;
+          c8->memory[(c8->cpu.I + 2) & MEM_MASK] = c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] % 100 % 10 / 1;
+          invalidate_decoded(c8, c8->cpu.I, 3);
+          c8->cpu.pc += 2;
           break;
         case 0x0055:
         /* Stores V0 to VX (including VX) in memory starting at address I.
         * The offset from I is increased by 1 for each value written,
         * but I itself is left unmodified. */
-          for(size_t i=0; i<=((cpu.opcode & 0x0F00) >> 8); i++)
-            memory[cpu.I + i] = cpu.V[i];
+          for(size_t i=0; i<=((c8->cpu.opcode & 0x0F00) >> 8); i++)
+            c8->memory[(c8->cpu.I + i) & MEM_MASK] = c8->cpu.V[i];
+          invalidate_decoded(c8, c8->cpu.I, ((c8->cpu.opcode & 0x0F00) >> 8) + 1);
 
           /* On the original interpreter, when the operation is done, I = I + X + 1. */
-          cpu.I += cpu.V[(cpu.opcode & 0x0F00) >> 8] + 1;
-          cpu.pc += 2;
+          c8->cpu.I += c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] + 1;
+          c8->cpu.pc += 2;
           break;
         case 0x0065:
           /* Fills V0 to VX (including VX) with values from memory starting at address I.
           * The offset from I is increased by 1 for each value written,
           * but I itself is left unmodified. */
-          for(size_t i=0; i<=((cpu.opcode & 0x0F00) >> 8); i++)
-            cpu.V[i] = memory[cpu.I + i];
+          for(size_t i=0; i<=((c8->cpu.opcode & 0x0F00) >> 8); i++)
+            c8->cpu.V[i] = c8->memory[(c8->cpu.I + i) & MEM_MASK];
 
           /* On the original interpreter, when the operation is done, I = I + X + 1. */
-          cpu.I += cpu.V[(cpu.opcode & 0x0F00) >> 8] + 1;
-          cpu.pc += 2;
+          c8->cpu.I += c8->cpu.V[(c8->cpu.opcode & 0x0F00) >> 8] + 1;
+          c8->cpu.pc += 2;
+          break;
+        case 0x0075:
+          /* FX75: Stores V0 to VX (including VX) in the RPL user flags. (SUPER-CHIP) */
+          memcpy(c8->flags, c8->cpu.V, ((c8->cpu.opcode & 0x0F00) >> 8) + 1);
+          c8->cpu.pc += 2;
+          break;
+        case 0x0085:
+          /* FX85: Fills V0 to VX (including VX) from the RPL user flags. (SUPER-CHIP) */
+          memcpy(c8->cpu.V, c8->flags, ((c8->cpu.opcode & 0x0F00) >> 8) + 1);
+          c8->cpu.pc += 2;
           break;
         default:
-          fprintf(stderr, "Unknown opcode 0x04%X\n", cpu.opcode);
-          exit(4);
+          return CHIP8_BAD_OPCODE;
       }
       break;
     default:
-      fprintf(stderr, "Unknown opcode 0x%04X\n", cpu.opcode);
-      exit(4);
+      return CHIP8_BAD_OPCODE;
   }
 
-  /* Update timers */
-  if(cpu.delay_timer > 0)
-    cpu.delay_timer--;
+  return CHIP8_OK;
+}
+
+/* Count both timers down, once per 60 Hz frame */
+void tick_timers(chip8_t *c8) {
+  if(c8->cpu.delay_timer > 0)
+    c8->cpu.delay_timer--;
+
+  if(c8->cpu.sound_timer > 0)
+    c8->cpu.sound_timer--;
+}
+
+/* True while pc sits on FX0A with no key down: the machine does nothing but
+* count cycles and timers down until a key is pressed.
+*/
+bool waiting_for_key(const chip8_t *c8) {
+  uint16_t pc = c8->cpu.pc & MEM_MASK;
+
+  if(c8->memory[pc] >> 4 != 0xF || c8->memory[(pc + 1) & MEM_MASK] != 0x0A)
+    return false;
+
+  for(int i=0; i<16; i++)
+    if(c8->keys[i])
+      return false;
+
+  return true;
+}
+
+/* Reference engine: one emulate_cycle() per instruction */
+int run_switch(chip8_t *c8, uint32_t max_cycles) {
+  int status = CHIP8_OK;
+
+  for(uint32_t i=0; i<max_cycles && status == CHIP8_OK; i++)
+    status = emulate_cycle(c8);
+
+  return status;
+}
+
+const chip8_engine_entry chip8_engines[] = {
+  {"switch", run_switch},
+  {"cached", run_cached},
+  {"jit",    run_jit},
+  {NULL,     NULL}
+};
+
+chip8_engine find_engine(const char *name) {
+  for(const chip8_engine_entry *e = chip8_engines; e->name != NULL; e++)
+    if(strcmp(name, e->name) == 0)
+      return e->run;
 
-  if(cpu.sound_timer > 0)
-    cpu.sound_timer--;
+  return NULL;
 }
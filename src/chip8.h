@@ -3,6 +3,8 @@
 
   #include <stdint.h>
   #include <stdbool.h>
+  #include <stddef.h>
+  #include <stdio.h>
 
   /* 4096 bytes */
   #define MEM_SIZE 4096
@@ -14,14 +16,35 @@
   * Only 3584 bytes of free memory to be used by program.
   */
   #define FREE_MEM MEM_SIZE-PRG_ADDR
-  #define DEBUG
+
+  /* Addresses wrap around the 4 KiB address space */
+  #define MEM_MASK (MEM_SIZE - 1)
 
   #define SCREEN_WIDTH 	64
   #define SCREEN_HEIGHT 32
 
+  /* SUPER-CHIP high resolution, 00FF switches to it and 00FE back */
+  #define HIRES_WIDTH   128
+  #define HIRES_HEIGHT  64
+
+  /* 64-bit framebuffer words per row */
+  #define ROW_WORDS (HIRES_WIDTH / 64)
+
+  /* The 4x5 font of FX29 starts at 0x50, the SUPER-CHIP 8x10 one of FX30 follows it */
+  #define BIG_FONT_ADDR 0xA0
+
+  /* Reasons emulate_cycle() stops the machine */
+  enum {
+    CHIP8_OK = 0,
+    CHIP8_BAD_OPCODE = 4,
+    CHIP8_BAD_STACK,
+    CHIP8_EXIT        /* 00FD: the program asked to stop */
+  };
+
   /* Structures */
   typedef struct {
     uint32_t cycle_count;
+    uint32_t rng;           /* xorshift32 state for CXNN, never 0 */
     uint16_t I;
     uint16_t pc;
     uint16_t stack[16];
@@ -31,21 +54,96 @@
     uint8_t delay_timer;
     uint8_t sound_timer;
     bool draw_flag;
+    bool hires;             /* SUPER-CHIP 128x64 mode */
   } CHIP8;
 
+  /* Handlers of the pre-decoded engine, one per instruction */
+  enum {
+    OP_DECODE = 0,    /* Not decoded yet, or invalidated by a write */
+    OP_CLS, OP_RET, OP_JP, OP_CALL, OP_SE_NN, OP_SNE_NN, OP_SE_VY, OP_LD_NN, OP_ADD_NN,
+    OP_LD_VY, OP_OR, OP_AND, OP_XOR, OP_ADD_VY, OP_SUB, OP_SHR, OP_SUBN, OP_SHL, OP_SNE_VY,
+    OP_LD_I, OP_JP_V0, OP_RND, OP_DRW, OP_SKP, OP_SKNP, OP_LD_VX_DT, OP_LD_K, OP_LD_DT_VX,
+    OP_LD_ST, OP_ADD_I, OP_LD_F, OP_LD_B, OP_LD_I_VX, OP_LD_VX_I,
+    OP_SCD, OP_SCR, OP_SCL, OP_EXIT, OP_LOW, OP_HIGH, OP_LD_HF, OP_LD_R, OP_LD_VX_R,   /* SUPER-CHIP */
+    OP_BAD,
+    OP_COUNT
+  };
+
+  /* An instruction decoded once with its operands already extracted */
+  typedef struct {
+    uint16_t opcode;
+    uint16_t nnn;
+    uint8_t op;
+    uint8_t x;
+    uint8_t y;
+    uint8_t nn;
+  } chip8_insn;
+
+  struct chip8_jit;
+
+  /* Whole machine state of one emulator instance. Registers and stack come
+  * first so the hot fields share cache lines, followed by the framebuffer and RAM.
+  */
+  typedef struct {
+    CHIP8 cpu;
+    bool keys[16];
+    uint8_t flags[16];              /* SUPER-CHIP RPL user flags of FX75 and FX85 */
+    /* ROW_WORDS words per row, bit 63 of the first is the leftmost pixel.
+    * Low resolution only uses the first word of the first SCREEN_HEIGHT rows.
+    */
+    uint64_t gfx[HIRES_HEIGHT][ROW_WORDS];
+    uint64_t dirty_rows;            /* Rows drawn to since the frontend last cleared it, bit n is row n */
+    uint8_t memory[MEM_SIZE];
+    chip8_insn decoded[MEM_SIZE];   /* Decode cache of the "cached" engine, per address */
+    struct chip8_jit *jit;          /* Code cache of the "jit" engine, NULL until first used */
+  } chip8_t;
+
+  /* Execution engines run up to max_cycles instructions and return CHIP8_OK,
+  * or the emulate_cycle() status that stopped the machine.
+  */
+  typedef int (*chip8_engine)(chip8_t *c8, uint32_t max_cycles);
+
+  /* Engines selectable by name, ending with a NULL name. The first one is the
+  * reference every other engine must match instruction for instruction.
+  */
+  typedef struct {
+    const char *name;
+    chip8_engine run;
+  } chip8_engine_entry;
+
+  extern const chip8_engine_entry chip8_engines[];
+
   /* Global Variables */
-  extern CHIP8 cpu;
-  extern uint8_t memory[MEM_SIZE];
   extern uint8_t fontset[80];
-  extern uint8_t gfx[SCREEN_WIDTH * SCREEN_HEIGHT];
-  extern bool keys[16];
+  extern uint8_t sprite_addr[16];
+  extern uint8_t big_fontset[160];
 
   /* Function Declarations */
-  void reset_chip8(void);
-  void init_chip8(void);
-  void emulate_cycle(void);
-  long fsize(FILE *fp);
-  void copy_to_memory(FILE *fp);
-  void load_rom(const char *n_game);
+  void reset_chip8(chip8_t *c8);
+  void init_chip8(chip8_t *c8);
+  int emulate_cycle(chip8_t *c8);
+  void tick_timers(chip8_t *c8);
+  bool waiting_for_key(const chip8_t *c8);
+  void seed_chip8(chip8_t *c8, uint32_t seed);
+  uint8_t random_byte(chip8_t *c8);
+  void draw_sprite(chip8_t *c8, uint8_t x, uint8_t y, uint8_t height);
+  void clear_screen(chip8_t *c8);
+  void scroll_down(chip8_t *c8, uint8_t n);
+  void scroll_right(chip8_t *c8);
+  void scroll_left(chip8_t *c8);
+  void set_hires(chip8_t *c8, bool on);
+  void invalidate_decoded(chip8_t *c8, uint16_t addr, size_t len);
+  int run_switch(chip8_t *c8, uint32_t max_cycles);
+  void decode_opcode(uint16_t opcode, chip8_insn *in);
+  int run_cached(chip8_t *c8, uint32_t max_cycles);
+  int run_jit(chip8_t *c8, uint32_t max_cycles);
+  void jit_invalidate(chip8_t *c8, uint16_t addr, size_t len);
+  void free_jit(chip8_t *c8);
+  chip8_engine find_engine(const char *name);
+  bool copy_rom_image(chip8_t *c8, const uint8_t *image, size_t size);
+  void load_rom(chip8_t *c8, const char *n_game);
+  uint64_t hash_gfx(const chip8_t *c8);
+  void expand_gfx(const uint64_t (*gfx)[ROW_WORDS], uint32_t *pixels, int width, int first_row, int n_rows, uint32_t on, uint32_t off);
+  void print_status(const chip8_t *c8, int status);
 
 #endif
@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8.h"
+
+/* Pre-decoded engine.
+*
+* Every address is decoded once into a chip8_insn holding the handler index
+* and the operands, so executing it is a table jump with no masking or shifting.
+* Entries are decoded lazily and dropped again by invalidate_decoded() when
+* FX33/FX55 or a ROM load write over them. It must behave exactly like
+* emulate_cycle(), which stays the reference.
+*/
+
+typedef int (*insn_handler)(chip8_t *c8, const chip8_insn *in);
+
+void decode_opcode(uint16_t opcode, chip8_insn *in) {
+  in->opcode = opcode;
+  in->nnn = opcode & 0x0FFF;
+  in->x = (opcode & 0x0F00) >> 8;
+  in->y = (opcode & 0x00F0) >> 4;
+  in->nn = opcode & 0x00FF;
+  in->op = OP_BAD;
+
+  switch(opcode & 0xF000) {
+    case 0x0000:
+      switch(in->nn) {
+        case 0xE0: in->op = OP_CLS; break;
+        case 0xEE: in->op = OP_RET; break;
+        case 0xFB: in->op = OP_SCR; break;
+        case 0xFC: in->op = OP_SCL; break;
+        case 0xFD: in->op = OP_EXIT; break;
+        case 0xFE: in->op = OP_LOW; break;
+        case 0xFF: in->op = OP_HIGH; break;
+        default:
+          if((in->nn & 0xF0) == 0xC0)
+            in->op = OP_SCD;
+      }
+      break;
+    case 0x1000: in->op = OP_JP; break;
+    case 0x2000: in->op = OP_CALL; break;
+    case 0x3000: in->op = OP_SE_NN; break;
+    case 0x4000: in->op = OP_SNE_NN; break;
+    case 0x5000: in->op = OP_SE_VY; break;
+    case 0x6000: in->op = OP_LD_NN; break;
+    case 0x7000: in->op = OP_ADD_NN; break;
+    case 0x8000:
+      switch(opcode & 0x000F) {
+        case 0x0: in->op = OP_LD_VY; break;
+        case 0x1: in->op = OP_OR; break;
+        case 0x2: in->op = OP_AND; break;
+        case 0x3: in->op = OP_XOR; break;
+        case 0x4: in->op = OP_ADD_VY; break;
+        case 0x5: in->op = OP_SUB; break;
+        case 0x6: in->op = OP_SHR; break;
+        case 0x7: in->op = OP_SUBN; break;
+        case 0xE: in->op = OP_SHL; break;
+      }
+      break;
+    case 0x9000: in->op = OP_SNE_VY; break;
+    case 0xA000: in->op = OP_LD_I; break;
+    case 0xB000: in->op = OP_JP_V0; break;
+    case 0xC000: in->op = OP_RND; break;
+    case 0xD000: in->op = OP_DRW; break;
+    case 0xE000:
+      if(in->nn == 0x9E)
+        in->op = OP_SKP;
+      else if(in->nn == 0xA1)
+        in->op = OP_SKNP;
+      break;
+    case 0xF000:
+      switch(in->nn) {
+        case 0x07: in->op = OP_LD_VX_DT; break;
+        case 0x0A: in->op = OP_LD_K; break;
+        case 0x15: in->op = OP_LD_DT_VX; break;
+        case 0x18: in->op = OP_LD_ST; break;
+        case 0x1E: in->op = OP_ADD_I; break;
+        case 0x29: in->op = OP_LD_F; break;
+        case 0x30: in->op = OP_LD_HF; break;
+        case 0x33: in->op = OP_LD_B; break;
+        case 0x55: in->op = OP_LD_I_VX; break;
+        case 0x65: in->op = OP_LD_VX_I; break;
+        case 0x75: in->op = OP_LD_R; break;
+        case 0x85: in->op = OP_LD_VX_R; break;
+      }
+      break;
+  }
+}
+
+static int op_cls(chip8_t *c8, const chip8_insn *in) {
+  clear_screen(c8);
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_ret(chip8_t *c8, const chip8_insn *in) {
+  if(c8->cpu.sp == 0)
+    return CHIP8_BAD_STACK;
+  c8->cpu.pc = c8->cpu.stack[--c8->cpu.sp] + 2;
+  return CHIP8_OK;
+}
+
+static int op_jp(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.pc = in->nnn;
+  return CHIP8_OK;
+}
+
+static int op_call(chip8_t *c8, const chip8_insn *in) {
+  if(c8->cpu.sp == 16)
+    return CHIP8_BAD_STACK;
+  c8->cpu.stack[c8->cpu.sp++] = c8->cpu.pc;
+  c8->cpu.pc = in->nnn;
+  return CHIP8_OK;
+}
+
+static int op_se_nn(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.pc += (c8->cpu.V[in->x] == in->nn) ? 4 : 2;
+  return CHIP8_OK;
+}
+
+static int op_sne_nn(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.pc += (c8->cpu.V[in->x] != in->nn) ? 4 : 2;
+  return CHIP8_OK;
+}
+
+static int op_se_vy(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.pc += (c8->cpu.V[in->x] == c8->cpu.V[in->y]) ? 4 : 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_nn(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[in->x] = in->nn;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_add_nn(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[in->x] += in->nn;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_vy(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[in->x] = c8->cpu.V[in->y];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_or(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[in->x] |= c8->cpu.V[in->y];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_and(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[in->x] &= c8->cpu.V[in->y];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_xor(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[in->x] ^= c8->cpu.V[in->y];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+/* VF is written before VX, as in emulate_cycle(), which matters when X is F */
+static int op_add_vy(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[0xF] = c8->cpu.V[in->y] > (0xFF - c8->cpu.V[in->x]);
+  c8->cpu.V[in->x] += c8->cpu.V[in->y];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_sub(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[0xF] = c8->cpu.V[in->x] > c8->cpu.V[in->y];
+  c8->cpu.V[in->x] -= c8->cpu.V[in->y];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_shr(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[0xF] = c8->cpu.V[in->x] & 0x1;
+  c8->cpu.V[in->x] >>= 1;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_subn(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[0xF] = !(c8->cpu.V[in->x] > c8->cpu.V[in->y]);
+  c8->cpu.V[in->x] = c8->cpu.V[in->y] - c8->cpu.V[in->x];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_shl(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[0xF] = c8->cpu.V[in->x] >> 7;
+  c8->cpu.V[in->x] <<= 1;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_sne_vy(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.pc += (c8->cpu.V[in->x] != c8->cpu.V[in->y]) ? 4 : 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_i(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.I = in->nnn;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_jp_v0(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.pc = c8->cpu.V[0x0] + in->nnn;
+  return CHIP8_OK;
+}
+
+static int op_rnd(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[in->x] = random_byte(c8) & in->nn;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_drw(chip8_t *c8, const chip8_insn *in) {
+  draw_sprite(c8, c8->cpu.V[in->x], c8->cpu.V[in->y], in->nn & 0xF);
+  c8->cpu.draw_flag = true;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_skp(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.pc += c8->keys[c8->cpu.V[in->x] & 0xF] ? 4 : 2;
+  return CHIP8_OK;
+}
+
+static int op_sknp(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.pc += !c8->keys[c8->cpu.V[in->x] & 0xF] ? 4 : 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_vx_dt(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[in->x] = c8->cpu.delay_timer;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+/* The highest pressed key wins, as in emulate_cycle() */
+static int op_ld_k(chip8_t *c8, const chip8_insn *in) {
+  for(int i=15; i>=0; i--) {
+    if(c8->keys[i]) {
+      c8->cpu.V[in->x] = (uint8_t)i;
+      c8->cpu.pc += 2;
+      return CHIP8_OK;
+    }
+  }
+
+  /* No key: run this instruction again */
+  return CHIP8_OK;
+}
+
+static int op_ld_dt_vx(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.delay_timer = c8->cpu.V[in->x];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_st(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.sound_timer = c8->cpu.V[in->x];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_add_i(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.V[0xF] = c8->cpu.I + c8->cpu.V[in->x] > 0xFFF;
+  c8->cpu.I += c8->cpu.V[in->x];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_f(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.I = sprite_addr[c8->cpu.V[in->x] & 0xF];
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_b(chip8_t *c8, const chip8_insn *in) {
+  uint8_t v = c8->cpu.V[in->x];
+
+  c8->memory[c8->cpu.I & MEM_MASK]       = v / 100;
+  c8->memory[(c8->cpu.I + 1) & MEM_MASK] = v % 100 / 10;
+  c8->memory[(c8->cpu.I + 2) & MEM_MASK] = v % 10;
+  invalidate_decoded(c8, c8->cpu.I, 3);
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+/* FX55 may overwrite the very instruction being executed, so the
+* operands are copied out of the cache before invalidating it.
+*/
+static int op_ld_i_vx(chip8_t *c8, const chip8_insn *in) {
+  uint8_t x = in->x;
+
+  for(int i=0; i<=x; i++)
+    c8->memory[(c8->cpu.I + i) & MEM_MASK] = c8->cpu.V[i];
+  invalidate_decoded(c8, c8->cpu.I, x + 1);
+
+  c8->cpu.I += c8->cpu.V[x] + 1;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_vx_i(chip8_t *c8, const chip8_insn *in) {
+  for(int i=0; i<=in->x; i++)
+    c8->cpu.V[i] = c8->memory[(c8->cpu.I + i) & MEM_MASK];
+
+  c8->cpu.I += c8->cpu.V[in->x] + 1;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_scd(chip8_t *c8, const chip8_insn *in) {
+  scroll_down(c8, in->nn & 0xF);
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_scr(chip8_t *c8, const chip8_insn *in) {
+  scroll_right(c8);
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_scl(chip8_t *c8, const chip8_insn *in) {
+  scroll_left(c8);
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_exit(chip8_t *c8, const chip8_insn *in) {
+  return CHIP8_EXIT;
+}
+
+static int op_low(chip8_t *c8, const chip8_insn *in) {
+  set_hires(c8, false);
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_high(chip8_t *c8, const chip8_insn *in) {
+  set_hires(c8, true);
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_hf(chip8_t *c8, const chip8_insn *in) {
+  c8->cpu.I = BIG_FONT_ADDR + (c8->cpu.V[in->x] & 0xF) * 10;
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_r(chip8_t *c8, const chip8_insn *in) {
+  memcpy(c8->flags, c8->cpu.V, in->x + 1);
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_ld_vx_r(chip8_t *c8, const chip8_insn *in) {
+  memcpy(c8->cpu.V, c8->flags, in->x + 1);
+  c8->cpu.pc += 2;
+  return CHIP8_OK;
+}
+
+static int op_bad(chip8_t *c8, const chip8_insn *in) {
+  return CHIP8_BAD_OPCODE;
+}
+
+static const insn_handler handlers[OP_COUNT] = {
+  [OP_CLS] = op_cls,          [OP_RET] = op_ret,          [OP_JP] = op_jp,
+  [OP_CALL] = op_call,        [OP_SE_NN] = op_se_nn,      [OP_SNE_NN] = op_sne_nn,
+  [OP_SE_VY] = op_se_vy,      [OP_LD_NN] = op_ld_nn,      [OP_ADD_NN] = op_add_nn,
+  [OP_LD_VY] = op_ld_vy,      [OP_OR] = op_or,            [OP_AND] = op_and,
+  [OP_XOR] = op_xor,          [OP_ADD_VY] = op_add_vy,    [OP_SUB] = op_sub,
+  [OP_SHR] = op_shr,          [OP_SUBN] = op_subn,        [OP_SHL] = op_shl,
+  [OP_SNE_VY] = op_sne_vy,    [OP_LD_I] = op_ld_i,        [OP_JP_V0] = op_jp_v0,
+  [OP_RND] = op_rnd,          [OP_DRW] = op_drw,          [OP_SKP] = op_skp,
+  [OP_SKNP] = op_sknp,        [OP_LD_VX_DT] = op_ld_vx_dt, [OP_LD_K] = op_ld_k,
+  [OP_LD_DT_VX] = op_ld_dt_vx, [OP_LD_ST] = op_ld_st,     [OP_ADD_I] = op_add_i,
+  [OP_LD_F] = op_ld_f,        [OP_LD_B] = op_ld_b,        [OP_LD_I_VX] = op_ld_i_vx,
+  [OP_LD_VX_I] = op_ld_vx_i,  [OP_SCD] = op_scd,          [OP_SCR] = op_scr,
+  [OP_SCL] = op_scl,          [OP_EXIT] = op_exit,        [OP_LOW] = op_low,
+  [OP_HIGH] = op_high,        [OP_LD_HF] = op_ld_hf,      [OP_LD_R] = op_ld_r,
+  [OP_LD_VX_R] = op_ld_vx_r,  [OP_BAD] = op_bad
+};
+
+int run_cached(chip8_t *c8, uint32_t max_cycles) {
+  for(uint32_t i=0; i<max_cycles; i++) {
+    uint16_t pc = c8->cpu.pc & MEM_MASK;
+    chip8_insn *in = &c8->decoded[pc];
+    int status;
+
+    if(in->op == OP_DECODE)
+      decode_opcode(c8->memory[pc] << 8 | c8->memory[(pc + 1) & MEM_MASK], in);
+
+    c8->cpu.opcode = in->opcode;
+    c8->cpu.cycle_count++;
+
+    if((status = handlers[in->op](c8, in)) != CHIP8_OK)
+      return status;
+  }
+
+  return CHIP8_OK;
+}
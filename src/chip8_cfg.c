@@ -0,0 +1,539 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chip8.h"
+#include "chip8_cfg.h"
+#include "chip8_dbg.h"
+#include "chip8_lib.h"
+
+/* Static analysis of a ROM.
+*
+* Code is found by walking from PRG_ADDR without running anything, so targets
+* computed at run time (BNNN, self-modifying code) are not followed. Blocks
+* start at PRG_ADDR, at jump and call targets and after calls and skips, and
+* end at the first instruction changing the flow of control.
+*/
+
+static const char *end_names[] = {
+  [END_FALL] = "fall", [END_JUMP] = "jump", [END_CALL] = "call", [END_SKIP] = "skip",
+  [END_RETURN] = "return", [END_INDIRECT] = "indirect", [END_EXIT] = "exit", [END_BAD] = "bad"
+};
+
+static const char *format_names[] = {
+  [CFG_TEXT] = "text", [CFG_DOT] = "dot", [CFG_JSON] = "json"
+};
+
+static const char *byte_names[] = {
+  [BYTE_UNKNOWN] = "unknown", [BYTE_CODE] = "code", [BYTE_OPERAND] = "code", [BYTE_DATA] = "data"
+};
+
+static bool is_reachable(const chip8_cfg *cfg, uint16_t addr) {
+  return addr <= MEM_SIZE - 2 && (cfg->reachable[addr / 8] >> (addr % 8) & 1);
+}
+
+/* Addresses are marked when queued, so each is queued once */
+static void queue(uint16_t addr, uint8_t *reachable, uint16_t *work, uint32_t *n_work) {
+  if(addr > MEM_SIZE - 2 || (reachable[addr / 8] >> (addr % 8) & 1))
+    return;
+
+  reachable[addr / 8] |= 1 << (addr % 8);
+  work[(*n_work)++] = addr;
+}
+
+uint32_t find_code(const uint8_t *memory, uint8_t *reachable, bool *schip) {
+  uint16_t work[MEM_SIZE];
+  uint32_t n_work = 0, found = 0;
+
+  *schip = false;
+  memset(reachable, 0, MEM_SIZE / 8);
+
+  queue(PRG_ADDR, reachable, work, &n_work);
+  while(n_work > 0) {
+    uint16_t addr = work[--n_work];
+    chip8_insn in;
+
+    found++;
+    decode_opcode(memory[addr] << 8 | memory[addr + 1], &in);
+    if(in.op >= OP_SCD && in.op <= OP_LD_VX_R)
+      *schip = true;
+
+    switch(in.op) {
+      case OP_JP:
+        queue(in.nnn, reachable, work, &n_work);
+        break;
+      case OP_CALL:
+        queue(in.nnn, reachable, work, &n_work);
+        queue(addr + 2, reachable, work, &n_work);
+        break;
+      case OP_SE_NN: case OP_SNE_NN: case OP_SE_VY: case OP_SNE_VY: case OP_SKP: case OP_SKNP:
+        queue(addr + 2, reachable, work, &n_work);
+        queue(addr + 4, reachable, work, &n_work);
+        break;
+      case OP_DRW:
+        *schip |= (in.nn & 0xF) == 0;
+        queue(addr + 2, reachable, work, &n_work);
+        break;
+      case OP_RET: case OP_JP_V0: case OP_EXIT: case OP_BAD:
+        break;
+      default:
+        queue(addr + 2, reachable, work, &n_work);
+    }
+  }
+
+  return found;
+}
+
+static void decode_at(const chip8_cfg *cfg, uint16_t addr, chip8_insn *in) {
+  decode_opcode(cfg->memory[addr] << 8 | cfg->memory[addr + 1], in);
+}
+
+/* Successors of a block within the code found, returns how many */
+static int successors(const chip8_cfg *cfg, const cfg_block *b, uint16_t *succ) {
+  int n = 0;
+
+  switch(b->end) {
+    case END_JUMP:
+      if(is_reachable(cfg, b->target))
+        succ[n++] = b->target;
+      break;
+    case END_SKIP:
+      if(is_reachable(cfg, b->last + 2))
+        succ[n++] = b->last + 2;
+      if(is_reachable(cfg, b->last + 4))
+        succ[n++] = b->last + 4;
+      break;
+    case END_FALL: case END_CALL:
+      if(is_reachable(cfg, b->last + 2))
+        succ[n++] = b->last + 2;
+      break;
+  }
+
+  return n;
+}
+
+/* Index of the block starting at start, -1 if none does */
+static int32_t block_index(const chip8_cfg *cfg, uint16_t start) {
+  uint32_t lo = 0, hi = cfg->n_blocks;
+
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if(cfg->blocks[mid].start < start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo < cfg->n_blocks && cfg->blocks[lo].start == start ? (int32_t)lo : -1;
+}
+
+static bool is_func(const chip8_cfg *cfg, uint16_t addr) {
+  if(addr == PRG_ADDR)
+    return true;
+  for(uint32_t i=0; i<cfg->n_blocks; i++)
+    if(cfg->blocks[i].end == END_CALL && cfg->blocks[i].target == addr)
+      return true;
+  return false;
+}
+
+static void add_call(chip8_cfg *cfg, uint16_t caller, uint16_t callee) {
+  for(uint32_t i=0; i<cfg->n_calls; i++)
+    if(cfg->calls[i].caller == caller && cfg->calls[i].callee == callee)
+      return;
+  if(cfg->n_calls < CFG_MAX_BLOCKS)
+    cfg->calls[cfg->n_calls++] = (cfg_call){caller, callee};
+}
+
+/* Visit the blocks of the subroutine at entry without following its calls.
+* Blocks shared by several subroutines keep the first one that reached them.
+*/
+static void walk_func(chip8_cfg *cfg, uint16_t entry, bool *seen) {
+  uint16_t work[2 * CFG_MAX_BLOCKS + 1];   /* Each block pushes its successors once */
+  uint32_t n_work = 0;
+
+  memset(seen, 0, CFG_MAX_BLOCKS * sizeof(bool));
+  work[n_work++] = entry;
+
+  while(n_work > 0) {
+    int32_t i = block_index(cfg, work[--n_work]);
+    uint16_t succ[2];
+    cfg_block *b;
+    int n;
+
+    if(i < 0 || seen[i])
+      continue;
+    seen[i] = true;
+    b = &cfg->blocks[i];
+
+    if(b->func == 0)
+      b->func = entry;
+    if(b->end == END_CALL)
+      add_call(cfg, entry, b->target);
+
+    n = successors(cfg, b, succ);
+    for(int s=0; s<n; s++)
+      work[n_work++] = succ[s];
+  }
+}
+
+void build_cfg(chip8_cfg *cfg, const uint8_t *image, size_t size) {
+  bool leaders[MEM_SIZE] = {false};
+  bool seen[CFG_MAX_BLOCKS];
+
+  if(size > FREE_MEM)
+    size = FREE_MEM;
+
+  memset(cfg->memory, 0, sizeof(cfg->memory));
+  memset(cfg->bytes, BYTE_UNKNOWN, sizeof(cfg->bytes));
+  memcpy(cfg->memory + PRG_ADDR, image, size);
+  cfg->size = (uint16_t)size;
+  cfg->n_blocks = 0;
+  cfg->n_calls = 0;
+  cfg->n_insns = find_code(cfg->memory, cfg->reachable, &cfg->schip);
+
+  /* Second bytes first, so an instruction starting inside another stays code */
+  for(uint16_t a=PRG_ADDR; a<=MEM_SIZE-2; a++)
+    if(is_reachable(cfg, a))
+      cfg->bytes[a + 1] = BYTE_OPERAND;
+
+  leaders[PRG_ADDR] = true;
+  for(uint16_t a=PRG_ADDR; a<=MEM_SIZE-2; a++) {
+    chip8_insn in;
+
+    if(!is_reachable(cfg, a))
+      continue;
+
+    cfg->bytes[a] = BYTE_CODE;
+    decode_at(cfg, a, &in);
+    switch(in.op) {
+      case OP_JP:
+        leaders[in.nnn] = true;
+        break;
+      case OP_CALL:
+        leaders[in.nnn] = true;
+        leaders[(a + 2) & MEM_MASK] = true;
+        break;
+      case OP_SE_NN: case OP_SNE_NN: case OP_SE_VY: case OP_SNE_VY: case OP_SKP: case OP_SKNP:
+        leaders[(a + 2) & MEM_MASK] = true;
+        leaders[(a + 4) & MEM_MASK] = true;
+        break;
+    }
+  }
+
+  /* Data runs from each address ANNN points I at to the next code */
+  for(uint16_t a=PRG_ADDR; a<=MEM_SIZE-2; a++) {
+    chip8_insn in;
+
+    if(cfg->bytes[a] != BYTE_CODE)
+      continue;
+    decode_at(cfg, a, &in);
+    if(in.op != OP_LD_I)
+      continue;
+    for(uint16_t d=in.nnn; d<PRG_ADDR + size && d >= PRG_ADDR && cfg->bytes[d] == BYTE_UNKNOWN; d++)
+      cfg->bytes[d] = BYTE_DATA;
+  }
+
+  /* A block runs straight from its leader, two bytes at a time */
+  for(uint16_t a=PRG_ADDR; a<=MEM_SIZE-2; a++) {
+    cfg_block *b;
+
+    if(!leaders[a] || !is_reachable(cfg, a))
+      continue;
+
+    b = &cfg->blocks[cfg->n_blocks++];
+    b->start = a;
+    b->target = 0;
+    b->func = 0;
+    for(uint16_t pc=a;; pc+=2) {
+      chip8_insn in;
+
+      decode_at(cfg, pc, &in);
+      b->last = pc;
+      switch(in.op) {
+        case OP_JP: b->end = END_JUMP; b->target = in.nnn; break;
+        case OP_CALL: b->end = END_CALL; b->target = in.nnn; break;
+        case OP_SE_NN: case OP_SNE_NN: case OP_SE_VY: case OP_SNE_VY: case OP_SKP: case OP_SKNP:
+          b->end = END_SKIP;
+          break;
+        case OP_RET: b->end = END_RETURN; break;
+        case OP_JP_V0: b->end = END_INDIRECT; break;
+        case OP_EXIT: b->end = END_EXIT; break;
+        case OP_BAD: b->end = END_BAD; break;
+        default:
+          if(pc + 2 > MEM_SIZE - 2 || leaders[pc + 2]) {
+            b->end = END_FALL;
+            break;
+          }
+          continue;
+      }
+      break;
+    }
+  }
+
+  /* The main program first, then subroutines by address */
+  walk_func(cfg, PRG_ADDR, seen);
+  for(uint32_t i=0; i<cfg->n_blocks; i++)
+    if(cfg->blocks[i].start != PRG_ADDR && is_func(cfg, cfg->blocks[i].start))
+      walk_func(cfg, cfg->blocks[i].start, seen);
+}
+
+/* A string in double quotes, as both DOT and JSON take it */
+static void put_string(const char *s, FILE *fp) {
+  fputc('"', fp);
+  for(; *s; s++) {
+    if(*s == '"' || *s == '\\')
+      fputc('\\', fp);
+    fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+static uint16_t fetch_at(const chip8_cfg *cfg, uint16_t addr) {
+  return cfg->memory[addr] << 8 | cfg->memory[addr + 1];
+}
+
+static void func_label(uint16_t entry, char *buf, size_t size) {
+  if(entry == PRG_ADDR)
+    snprintf(buf, size, "main");
+  else
+    snprintf(buf, size, "sub_%03X", entry);
+}
+
+/* End of the listing: the ROM, or the last code past it */
+static uint16_t listing_end(const chip8_cfg *cfg) {
+  uint16_t end = PRG_ADDR + cfg->size;
+
+  for(uint32_t i=0; i<cfg->n_blocks; i++)
+    if(cfg->blocks[i].last + 2 > end)
+      end = cfg->blocks[i].last + 2;
+
+  return end;
+}
+
+static void write_text(const chip8_cfg *cfg, const char *name, FILE *fp) {
+  uint16_t end = listing_end(cfg), a = PRG_ADDR;
+  const cfg_block *b = NULL;
+  char text[DISASM_SIZE], label[16];
+
+  fprintf(fp, "; %s: %u bytes, %s, %u instructions in %u blocks\n", name, cfg->size,
+          platform_name(cfg->schip ? PLATFORM_SCHIP : PLATFORM_CHIP8), cfg->n_insns, cfg->n_blocks);
+  for(uint32_t i=0; i<cfg->n_calls; i++) {
+    func_label(cfg->calls[i].caller, label, sizeof(label));
+    fprintf(fp, "; %s calls sub_%03X\n", label, cfg->calls[i].callee);
+  }
+
+  while(a < end) {
+    if(cfg->bytes[a] == BYTE_CODE) {
+      int32_t start = block_index(cfg, a);
+
+      if(start >= 0) {
+        b = &cfg->blocks[start];
+        if(b->func == b->start) {
+          func_label(b->start, label, sizeof(label));
+          fprintf(fp, "\n%s:\n", label);
+        } else
+          fprintf(fp, "\nL_%03X:\n", b->start);
+      }
+
+      disassemble(fetch_at(cfg, a), text, sizeof(text));
+      fprintf(fp, "  %03X  %04X  %s\n", a, fetch_at(cfg, a), text);
+
+      if(b != NULL && a == b->last) {
+        uint16_t succ[2];
+        int n = successors(cfg, b, succ);
+
+        fprintf(fp, "        ; %s", end_names[b->end]);
+        for(int i=0; i<n; i++)
+          fprintf(fp, "%s%03X", i ? ", " : " -> ", succ[i]);
+        fputc('\n', fp);
+        b = NULL;
+      }
+
+      /* An instruction starting on its second byte comes next */
+      a += cfg->bytes[a + 1] == BYTE_CODE ? 1 : 2;
+    } else {
+      uint8_t kind = cfg->bytes[a];
+      uint16_t n = 0;
+
+      if(kind == BYTE_OPERAND)
+        kind = BYTE_UNKNOWN;
+      fprintf(fp, "  %03X        DB", a);
+      while(n < 8 && a + n < end && cfg->bytes[a + n] != BYTE_CODE
+            && (cfg->bytes[a + n] == BYTE_DATA) == (kind == BYTE_DATA))
+        fprintf(fp, " %02X", cfg->memory[a + n++]);
+      fprintf(fp, "%*s; %s\n", 3 * (8 - n) + 2, "", kind == BYTE_DATA ? "data" : "unreached");
+      a += n;
+    }
+  }
+}
+
+static void write_dot(const chip8_cfg *cfg, const char *name, FILE *fp) {
+  char text[DISASM_SIZE], label[16];
+
+  fprintf(fp, "digraph ");
+  put_string(name, fp);
+  fprintf(fp, " {\n  node [shape=box, fontname=\"monospace\"];\n");
+
+  /* One cluster per subroutine, with the blocks it was first found to run */
+  for(uint32_t f=0; f<cfg->n_blocks; f++) {
+    if(cfg->blocks[f].func != cfg->blocks[f].start)
+      continue;
+
+    func_label(cfg->blocks[f].start, label, sizeof(label));
+    fprintf(fp, "  subgraph cluster_%03X {\n    label=\"%s\";\n", cfg->blocks[f].start, label);
+    for(uint32_t i=0; i<cfg->n_blocks; i++) {
+      const cfg_block *b = &cfg->blocks[i];
+
+      if(b->func != cfg->blocks[f].start)
+        continue;
+      fprintf(fp, "    b%03X [label=\"", b->start);
+      for(uint16_t pc=b->start; pc<=b->last; pc+=2) {
+        disassemble(fetch_at(cfg, pc), text, sizeof(text));
+        fprintf(fp, "%03X: %s\\l", pc, text);
+      }
+      fprintf(fp, "\"];\n");
+    }
+    fprintf(fp, "  }\n");
+  }
+
+  for(uint32_t i=0; i<cfg->n_blocks; i++) {
+    const cfg_block *b = &cfg->blocks[i];
+    uint16_t succ[2];
+    int n = successors(cfg, b, succ);
+
+    for(int s=0; s<n; s++)
+      fprintf(fp, "  b%03X -> b%03X;\n", b->start, succ[s]);
+    if(b->end == END_CALL && block_index(cfg, b->target) >= 0)
+      fprintf(fp, "  b%03X -> b%03X [style=dashed];\n", b->start, b->target);
+  }
+
+  fprintf(fp, "}\n");
+}
+
+static void write_json(const chip8_cfg *cfg, const char *name, FILE *fp) {
+  uint32_t counts[4] = {0};
+  char text[DISASM_SIZE];
+  bool first = true;
+
+  for(uint16_t a=PRG_ADDR; a<PRG_ADDR + cfg->size; a++)
+    counts[cfg->bytes[a] == BYTE_OPERAND ? BYTE_CODE : cfg->bytes[a]]++;
+
+  fprintf(fp, "  {\n    \"name\": ");
+  put_string(name, fp);
+  fprintf(fp, ",\n    \"size\": %u,\n    \"platform\": \"%s\",\n    \"instructions\": %u,\n", cfg->size,
+          platform_name(cfg->schip ? PLATFORM_SCHIP : PLATFORM_CHIP8), cfg->n_insns);
+  fprintf(fp, "    \"bytes\": {\"code\": %u, \"data\": %u, \"unknown\": %u},\n    \"blocks\": [",
+          counts[BYTE_CODE], counts[BYTE_DATA], counts[BYTE_UNKNOWN]);
+
+  for(uint32_t i=0; i<cfg->n_blocks; i++) {
+    const cfg_block *b = &cfg->blocks[i];
+    uint16_t succ[2];
+    int n = successors(cfg, b, succ);
+
+    fprintf(fp, "%s\n      {\"start\": %u, \"last\": %u, \"func\": %u, \"end\": \"%s\", \"successors\": [",
+            i ? "," : "", b->start, b->last, b->func, end_names[b->end]);
+    for(int s=0; s<n; s++)
+      fprintf(fp, "%s%u", s ? ", " : "", succ[s]);
+    fprintf(fp, "],");
+    if(b->end == END_CALL)
+      fprintf(fp, " \"callee\": %u,", b->target);
+    fprintf(fp, " \"code\": [");
+    for(uint16_t pc=b->start; pc<=b->last; pc+=2) {
+      disassemble(fetch_at(cfg, pc), text, sizeof(text));
+      fprintf(fp, "%s\n        {\"pc\": %u, \"opcode\": \"%04X\", \"mnemonic\": ", pc != b->start ? "," : "",
+              pc, fetch_at(cfg, pc));
+      put_string(text, fp);
+      fputc('}', fp);
+    }
+    fprintf(fp, "]}");
+  }
+
+  fprintf(fp, "\n    ],\n    \"calls\": [");
+  for(uint32_t i=0; i<cfg->n_calls; i++)
+    fprintf(fp, "%s\n      {\"caller\": %u, \"callee\": %u}", i ? "," : "", cfg->calls[i].caller,
+            cfg->calls[i].callee);
+
+  /* Runs of bytes of one kind, code included, covering the whole ROM */
+  fprintf(fp, "\n    ],\n    \"ranges\": [");
+  for(uint16_t a=PRG_ADDR, end=PRG_ADDR + cfg->size; a<end;) {
+    const char *kind = byte_names[cfg->bytes[a]];
+    uint16_t start = a;
+
+    while(a < end && byte_names[cfg->bytes[a]] == kind)
+      a++;
+    fprintf(fp, "%s\n      {\"start\": %u, \"end\": %u, \"kind\": \"%s\"}", first ? "" : ",", start, a, kind);
+    first = false;
+  }
+  fprintf(fp, "\n    ]\n  }");
+}
+
+int find_cfg_format(const char *name) {
+  for(int i=0; i<(int)(sizeof(format_names) / sizeof(format_names[0])); i++)
+    if(strcmp(format_names[i], name) == 0)
+      return i;
+  return -1;
+}
+
+void write_cfg(const chip8_cfg *cfg, const char *name, int format, FILE *fp) {
+  switch(format) {
+    case CFG_DOT:
+      write_dot(cfg, name, fp);
+      break;
+    case CFG_JSON:
+      write_json(cfg, name, fp);
+      break;
+    default:
+      write_text(cfg, name, fp);
+  }
+}
+
+int run_disasm(const char **files, int n_files, int format) {
+  chip8_cfg *cfg = malloc(sizeof(chip8_cfg));
+  struct timespec start, end;
+  int failures = 0, done = 0;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if(format == CFG_JSON)
+    printf("[");
+
+  for(int i=0; i<n_files; i++) {
+    mapped_file image;
+
+    if(!map_file(files[i], &image)) {
+      failures++;
+      continue;
+    }
+
+    if(image.size == 0 || image.size > FREE_MEM) {
+      fprintf(stderr, "%s: empty or exceeds free memory\n", files[i]);
+      unmap_file(&image);
+      failures++;
+      continue;
+    }
+
+    build_cfg(cfg, image.data, image.size);
+    unmap_file(&image);
+
+    if(format == CFG_JSON)
+      printf("%s\n", done ? "," : "");
+    else if(done)
+      printf("\n");
+    write_cfg(cfg, files[i], format, stdout);
+    done++;
+  }
+
+  if(format == CFG_JSON)
+    printf("\n]\n");
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "Disassembled %d ROMs in %.3f ms, %d failed to load\n", done, secs * 1e3, failures);
+
+  free(cfg);
+
+  return failures != 0;
+}
@@ -0,0 +1,89 @@
+#ifndef _CHIP8_CFG_H_
+#define _CHIP8_CFG_H_
+
+  #include <stdint.h>
+  #include <stdbool.h>
+  #include <stdio.h>
+  #include "chip8.h"
+
+  /* Blocks start at reachable addresses, and an instruction may start on the
+  * second byte of another one, so every address can start a block.
+  */
+  #define CFG_MAX_BLOCKS MEM_SIZE
+
+  enum {
+    CFG_TEXT = 0,
+    CFG_DOT,
+    CFG_JSON
+  };
+
+  /* What a byte of the program holds */
+  enum {
+    BYTE_UNKNOWN = 0,   /* Neither reached nor referenced */
+    BYTE_CODE,          /* First byte of a reachable instruction */
+    BYTE_OPERAND,       /* Second byte of one */
+    BYTE_DATA           /* Pointed at by a reachable ANNN, up to the next code */
+  };
+
+  /* How a block ends, which gives its successors */
+  enum {
+    END_FALL = 0,       /* Runs into a leader: next */
+    END_JUMP,           /* 1NNN: target */
+    END_CALL,           /* 2NNN: next, once target returns */
+    END_SKIP,           /* Conditional skip: next and the one after */
+    END_RETURN,         /* 00EE */
+    END_INDIRECT,       /* BNNN, depends on V0 */
+    END_EXIT,           /* 00FD */
+    END_BAD             /* An opcode no engine runs */
+  };
+
+  typedef struct {
+    uint16_t start;
+    uint16_t last;          /* Address of the last instruction */
+    uint16_t target;        /* Of END_JUMP and END_CALL */
+    uint16_t func;          /* Entry of the first subroutine found to run it */
+    uint8_t end;
+  } cfg_block;
+
+  typedef struct {
+    uint16_t caller;        /* Entry of the calling subroutine, PRG_ADDR for the main program */
+    uint16_t callee;
+  } cfg_call;
+
+  /* Static control flow graph of a program loaded at PRG_ADDR */
+  typedef struct {
+    uint8_t memory[MEM_SIZE];
+    uint8_t bytes[MEM_SIZE];        /* BYTE_* of each address */
+    uint8_t reachable[MEM_SIZE / 8];  /* Bit n set when an instruction starts at address n */
+    uint16_t size;                  /* Of the ROM image */
+    uint32_t n_insns;
+    bool schip;                     /* A reachable SUPER-CHIP instruction */
+    cfg_block blocks[CFG_MAX_BLOCKS];   /* Sorted by address */
+    uint32_t n_blocks;
+    cfg_call calls[CFG_MAX_BLOCKS];     /* Subroutine to subroutine, without duplicates */
+    uint32_t n_calls;
+  } chip8_cfg;
+
+  /* Mark in reachable every instruction reachable from PRG_ADDR by following
+  * jumps, calls and both ways of every skip. BNNN, 00EE and 00FD end a path.
+  * Returns the number of instructions found and whether any needs a SUPER-CHIP.
+  */
+  uint32_t find_code(const uint8_t *memory, uint8_t *reachable, bool *schip);
+
+  /* Analyse a ROM image: its blocks, the subroutines running them, the calls
+  * between subroutines and which bytes are code or data.
+  */
+  void build_cfg(chip8_cfg *cfg, const uint8_t *image, size_t size);
+
+  /* CFG_* format called name, -1 if there's none */
+  int find_cfg_format(const char *name);
+
+  /* Write the graph as a listing, a Graphviz digraph or a JSON object named name */
+  void write_cfg(const chip8_cfg *cfg, const char *name, int format, FILE *fp);
+
+  /* Disassemble every ROM of files to stdout in format, JSON ones as one array.
+  * Returns 0 when all could be read, non-zero otherwise.
+  */
+  int run_disasm(const char **files, int n_files, int format);
+
+#endif
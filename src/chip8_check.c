@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8.h"
+#include "chip8_dbg.h"
+#include "chip8_state.h"
+#include "chip8_lib.h"
+#include "chip8_check.h"
+
+/* Instructions in a generated program */
+#define RANDOM_PROGRAM 512
+
+#define DIFF_SIZE 64
+
+/* Both machines and the state they were last found equal in */
+typedef struct {
+  chip8_t *ref;
+  chip8_t *cand;
+  chip8_engine reference;
+  chip8_engine candidate;
+  chip8_state checkpoint;
+  uint32_t keys_rng;
+} lockstep;
+
+static uint32_t xorshift(uint32_t *s) {
+  *s ^= *s << 13;
+  *s ^= *s >> 17;
+  *s ^= *s << 5;
+  return *s;
+}
+
+/* Describe the first difference between the machines, false if there is none */
+static bool diff_machines(const chip8_t *a, const chip8_t *b, char *what) {
+  if(a->cpu.pc != b->cpu.pc)
+    snprintf(what, DIFF_SIZE, "pc %03X / %03X", a->cpu.pc, b->cpu.pc);
+  else if(a->cpu.opcode != b->cpu.opcode)
+    snprintf(what, DIFF_SIZE, "opcode %04X / %04X", a->cpu.opcode, b->cpu.opcode);
+  else if(a->cpu.I != b->cpu.I)
+    snprintf(what, DIFF_SIZE, "I %03X / %03X", a->cpu.I, b->cpu.I);
+  else if(a->cpu.sp != b->cpu.sp)
+    snprintf(what, DIFF_SIZE, "sp %X / %X", a->cpu.sp, b->cpu.sp);
+  else if(a->cpu.delay_timer != b->cpu.delay_timer)
+    snprintf(what, DIFF_SIZE, "DT %02X / %02X", a->cpu.delay_timer, b->cpu.delay_timer);
+  else if(a->cpu.sound_timer != b->cpu.sound_timer)
+    snprintf(what, DIFF_SIZE, "ST %02X / %02X", a->cpu.sound_timer, b->cpu.sound_timer);
+  else if(a->cpu.cycle_count != b->cpu.cycle_count)
+    snprintf(what, DIFF_SIZE, "cycle count %u / %u", a->cpu.cycle_count, b->cpu.cycle_count);
+  else if(a->cpu.rng != b->cpu.rng)
+    snprintf(what, DIFF_SIZE, "random state %08X / %08X", a->cpu.rng, b->cpu.rng);
+  else {
+    for(int i=0; i<16; i++)
+      if(a->cpu.V[i] != b->cpu.V[i]) {
+        snprintf(what, DIFF_SIZE, "V%X %02X / %02X", i, a->cpu.V[i], b->cpu.V[i]);
+        return true;
+      }
+    for(int i=0; i<16; i++)
+      if(a->cpu.stack[i] != b->cpu.stack[i]) {
+        snprintf(what, DIFF_SIZE, "stack[%d] %03X / %03X", i, a->cpu.stack[i], b->cpu.stack[i]);
+        return true;
+      }
+    for(int i=0; i<MEM_SIZE; i++)
+      if(a->memory[i] != b->memory[i]) {
+        snprintf(what, DIFF_SIZE, "memory[%03X] %02X / %02X", i, a->memory[i], b->memory[i]);
+        return true;
+      }
+    for(int i=0; i<16; i++)
+      if(a->flags[i] != b->flags[i]) {
+        snprintf(what, DIFF_SIZE, "flag %X %02X / %02X", i, a->flags[i], b->flags[i]);
+        return true;
+      }
+    if(a->cpu.hires != b->cpu.hires) {
+      snprintf(what, DIFF_SIZE, "resolution %s / %s", a->cpu.hires ? "high" : "low", b->cpu.hires ? "high" : "low");
+      return true;
+    }
+    for(int i=0; i<HIRES_HEIGHT; i++)
+      if(memcmp(a->gfx[i], b->gfx[i], sizeof(a->gfx[i])) != 0) {
+        snprintf(what, DIFF_SIZE, "screen row %d", i);
+        return true;
+      }
+    return false;
+  }
+
+  return true;
+}
+
+/* Run both machines n instructions from the checkpoint, true if they end up different */
+static bool diverges(lockstep *ls, uint32_t n, char *what) {
+  int s1, s2;
+
+  load_state(ls->ref, &ls->checkpoint);
+  load_state(ls->cand, &ls->checkpoint);
+  s1 = ls->reference(ls->ref, n);
+  s2 = ls->candidate(ls->cand, n);
+
+  if(s1 != s2) {
+    snprintf(what, DIFF_SIZE, "status %d / %d", s1, s2);
+    return true;
+  }
+
+  return diff_machines(ls->ref, ls->cand, what);
+}
+
+/* Narrow a mismatch after n instructions down to the first instruction at fault */
+static void report(lockstep *ls, const char *name, uint32_t n) {
+  uint32_t lo = 1, hi = n;
+  char what[DIFF_SIZE], text[DISASM_SIZE];
+  uint16_t pc, opcode;
+
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if(diverges(ls, mid, what))
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  /* Where the reference machine was just before that instruction */
+  diverges(ls, lo - 1, what);
+  pc = ls->ref->cpu.pc & MEM_MASK;
+  opcode = ls->ref->memory[pc] << 8 | ls->ref->memory[(pc + 1) & MEM_MASK];
+  disassemble(opcode, text, sizeof(text));
+  diverges(ls, lo, what);
+
+  printf("%s: DIVERGED at cycle %u, %03X: %04X  %s  (reference / candidate: %s)\n",
+         name, ls->checkpoint.cycle_count + lo - 1, pc, opcode, text, what);
+}
+
+/* Run a program in lockstep from boot, returns false on a mismatch */
+static bool check_program(lockstep *ls, const chip8_t *boot, const char *name, const check_options *opt) {
+  uint64_t done = 0, start = boot->cpu.cycle_count;
+  char what[DIFF_SIZE];
+  int status = CHIP8_OK;
+
+  /* Through a save state, so each machine keeps its own code caches */
+  save_state(boot, &ls->checkpoint);
+  load_state(ls->ref, &ls->checkpoint);
+  load_state(ls->cand, &ls->checkpoint);
+
+  while(done < opt->cycles) {
+    uint32_t chunk = opt->interval, in_frame = ls->ref->cpu.cycle_count % opt->ipf;
+    int s1, s2;
+
+    /* Chunks end at frame boundaries, where timers tick on both machines */
+    if(opt->ipf - in_frame < chunk)
+      chunk = opt->ipf - in_frame;
+    if(opt->cycles - done < chunk)
+      chunk = (uint32_t)(opt->cycles - done);
+
+    /* Now and then a key changes, on both machines alike */
+    if(xorshift(&ls->keys_rng) % 8 == 0) {
+      uint8_t key = ls->keys_rng >> 8 & 0xF;
+
+      ls->ref->keys[key] = ls->cand->keys[key] = !ls->ref->keys[key];
+    }
+
+    save_state(ls->ref, &ls->checkpoint);
+    s1 = ls->reference(ls->ref, chunk);
+    s2 = ls->candidate(ls->cand, chunk);
+
+    if(s1 != s2 || diff_machines(ls->ref, ls->cand, what)) {
+      report(ls, name, chunk);
+      return false;
+    }
+
+    if((status = s1) != CHIP8_OK)
+      break;
+
+    done += chunk;
+    if(ls->ref->cpu.cycle_count % opt->ipf == 0) {
+      tick_timers(ls->ref);
+      tick_timers(ls->cand);
+    }
+  }
+
+  printf("%s: ok, %llu instructions", name, (unsigned long long)(ls->ref->cpu.cycle_count - start));
+  if(status != CHIP8_OK)
+    printf(", both stopped with status %d", status);
+  putchar('\n');
+
+  return true;
+}
+
+static bool load_file(chip8_t *boot, const char *path) {
+  mapped_file image;
+  bool ok;
+
+  if(!map_file(path, &image))
+    return false;
+
+  /* A save state skips the boot sequence of a ROM */
+  ok = image.size > 0 && (is_state(image.data, image.size) ? load_state(boot, (const chip8_state *)image.data)
+                                                           : copy_rom_image(boot, image.data, image.size));
+  if(!ok)
+    fprintf(stderr, "%s: empty, exceeds free memory or unreadable save state\n", path);
+
+  unmap_file(&image);
+
+  return ok;
+}
+
+/* Random instructions of every kind, with jumps and calls kept inside the program */
+static void random_program(chip8_t *boot, uint32_t *rng) {
+  static const uint16_t kinds[] = {
+    0x00E0, 0x00EE, 0x1000, 0x2000, 0x3000, 0x4000, 0x5000, 0x6000, 0x7000,
+    0x8000, 0x8001, 0x8002, 0x8003, 0x8004, 0x8005, 0x8006, 0x8007, 0x800E, 0x9000,
+    0xA000, 0xB000, 0xC000, 0xD000, 0xE09E, 0xE0A1, 0xF007, 0xF00A, 0xF015, 0xF018,
+    0xF01E, 0xF029, 0xF033, 0xF055, 0xF065,
+    /* SUPER-CHIP, without 00FD which would end the program */
+    0x00C0, 0x00FB, 0x00FC, 0x00FE, 0x00FF, 0xF030, 0xF075, 0xF085
+  };
+  uint8_t image[2 * RANDOM_PROGRAM];
+
+  for(int i=0; i<RANDOM_PROGRAM; i++) {
+    uint16_t kind = kinds[xorshift(rng) % (sizeof(kinds) / sizeof(kinds[0]))];
+    uint16_t x = (xorshift(rng) & 0xF) << 8, y = (xorshift(rng) & 0xF) << 4;
+    uint16_t target = PRG_ADDR + 2 * (xorshift(rng) % RANDOM_PROGRAM);
+    uint16_t opcode;
+
+    switch(kind & 0xF000) {
+      case 0x0000:
+        opcode = kind == 0x00C0 ? kind | (xorshift(rng) & 0xF) : kind;
+        break;
+      case 0x1000: case 0x2000: case 0xB000:
+        opcode = kind | target;
+        break;
+      case 0x5000: case 0x8000: case 0x9000:
+        opcode = kind | x | y;
+        break;
+      case 0xA000:
+        opcode = kind | (xorshift(rng) & 0xFFF);
+        break;
+      case 0xD000:
+        opcode = kind | x | y | (xorshift(rng) & 0xF);
+        break;
+      case 0xE000:
+        /* Half the time load VX first, mostly past 0xF, as key indexes wrap */
+        if(i > 0 && (xorshift(rng) & 1)) {
+          image[2 * (i - 1)] = 0x60 | (x >> 8);
+          image[2 * (i - 1) + 1] = xorshift(rng) & 0xFF;
+        }
+        opcode = kind | x;
+        break;
+      case 0xF000:
+        opcode = kind | x;
+        break;
+      default:
+        opcode = kind | x | (xorshift(rng) & 0xFF);
+    }
+
+    image[2 * i] = opcode >> 8;
+    image[2 * i + 1] = opcode & 0xFF;
+  }
+
+  copy_rom_image(boot, image, sizeof(image));
+}
+
+int run_check(chip8_engine candidate, const char **files, int n_files, uint32_t n_random,
+              const check_options *opt) {
+  chip8_t *boot = calloc(1, sizeof(chip8_t));
+  uint32_t program_rng = opt->seed | 1;
+  int failures = 0;
+  lockstep ls;
+
+  ls.ref = calloc(1, sizeof(chip8_t));
+  ls.cand = calloc(1, sizeof(chip8_t));
+  ls.reference = chip8_engines[0].run;
+  ls.candidate = candidate;
+  ls.keys_rng = opt->seed | 1;
+
+  for(int i=0; i<n_files + (int)n_random; i++) {
+    char name[32];
+
+    init_chip8(boot);
+    seed_chip8(boot, opt->seed + i);
+
+    if(i < n_files) {
+      if(!load_file(boot, files[i])) {
+        failures++;
+        continue;
+      }
+    } else
+      random_program(boot, &program_rng);
+
+    snprintf(name, sizeof(name), "random #%d", i - n_files + 1);
+    if(!check_program(&ls, boot, i < n_files ? files[i] : name, opt))
+      failures++;
+  }
+
+  printf("Checked %d programs: %d diverged or failed to load\n", n_files + (int)n_random, failures);
+
+  free_jit(ls.cand);
+  free_jit(ls.ref);
+  free(ls.ref);
+  free(ls.cand);
+  free(boot);
+
+  return failures != 0;
+}
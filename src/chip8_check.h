@@ -0,0 +1,26 @@
+#ifndef _CHIP8_CHECK_H_
+#define _CHIP8_CHECK_H_
+
+  #include <stdint.h>
+  #include "chip8.h"
+
+  typedef struct {
+    uint64_t cycles;      /* Instructions run per program */
+    uint32_t interval;    /* Instructions between two comparisons */
+    uint32_t ipf;         /* Timers tick every ipf instructions, as in a frame */
+    uint32_t seed;        /* CXNN seed, key presses and random programs */
+  } check_options;
+
+  /* Run candidate in lockstep with the reference engine, the first entry of
+  * chip8_engines, on every file of files (ROMs or save states) and then on
+  * n_random generated programs, with the same seed and key presses on both.
+  * Registers, stack, timers, memory and screen are compared every interval
+  * instructions; on a mismatch the interval is bisected down to the first
+  * instruction whose result differs, which is reported.
+  *
+  * Returns 0 when every program matched, non-zero otherwise.
+  */
+  int run_check(chip8_engine candidate, const char **files, int n_files, uint32_t n_random,
+                const check_options *opt);
+
+#endif
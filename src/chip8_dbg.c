@@ -1,189 +1,252 @@
+#define _POSIX_C_SOURCE 200809L
 #ifdef _WIN32
   #include <curses.h>
 #else
   #include <ncurses.h>
 #endif
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "chip8.h"
+#include "chip8_dbg.h"
+
+/* Snapshots in flight between the emulation and debugger threads */
+#define DBG_RING 8
+
+/* Screen refreshes per second */
+#define DBG_REFRESH_HZ 30
+
+/* Single producer, single consumer: the emulation thread posts, the debugger
+* thread takes. A full ring drops the snapshot rather than stall emulation.
+*/
+static struct {
+  dbg_snapshot slots[DBG_RING];
+  _Atomic uint32_t head;    /* Next slot to read, moved by the debugger thread */
+  _Atomic uint32_t tail;    /* Next slot to write, moved by the emulation thread */
+} ring;
+
+/* Instruction history, written only by the emulation thread */
+static dbg_trace history[DBG_HISTORY];
+static uint32_t history_len;
+
+static chip8_engine traced_engine;
+static pthread_t dbg_tid;
+static atomic_bool dbg_quit;
+static bool dbg_running = false;
+
+/* Instructions without operands, and those with only VX as one */
+static const char *plain_names[OP_COUNT] = {
+  [OP_CLS] = "CLS", [OP_RET] = "RET", [OP_SCR] = "SCR", [OP_SCL] = "SCL",
+  [OP_EXIT] = "EXIT", [OP_LOW] = "LOW", [OP_HIGH] = "HIGH"
+};
+
+static const char *vx_formats[OP_COUNT] = {
+  [OP_SKP] = "SKP V%X", [OP_SKNP] = "SKNP V%X", [OP_LD_VX_DT] = "LD V%X, DT",
+  [OP_LD_K] = "LD V%X, K", [OP_LD_DT_VX] = "LD DT, V%X", [OP_LD_ST] = "LD ST, V%X",
+  [OP_ADD_I] = "ADD I, V%X", [OP_LD_F] = "LD F, V%X", [OP_LD_HF] = "LD HF, V%X",
+  [OP_LD_B] = "LD B, V%X", [OP_LD_I_VX] = "LD [I], V%X", [OP_LD_VX_I] = "LD V%X, [I]",
+  [OP_LD_R] = "LD R, V%X", [OP_LD_VX_R] = "LD V%X, R"
+};
+
+static const char *vx_vy_formats[OP_COUNT] = {
+  [OP_SE_VY] = "SE V%X, V%X", [OP_LD_VY] = "LD V%X, V%X", [OP_OR] = "OR V%X, V%X",
+  [OP_AND] = "AND V%X, V%X", [OP_XOR] = "XOR V%X, V%X", [OP_ADD_VY] = "ADD V%X, V%X",
+  [OP_SUB] = "SUB V%X, V%X", [OP_SHR] = "SHR V%X {, V%X}", [OP_SUBN] = "SUBN V%X, V%X",
+  [OP_SHL] = "SHL V%X {, V%X}", [OP_SNE_VY] = "SNE V%X, V%X"
+};
+
+static const char *vx_nn_formats[OP_COUNT] = {
+  [OP_SE_NN] = "SE V%X, %02X", [OP_SNE_NN] = "SNE V%X, %02X", [OP_LD_NN] = "LD V%X, %02X",
+  [OP_ADD_NN] = "ADD V%X, %02X", [OP_RND] = "RND V%X, %02X"
+};
+
+static const char *nnn_formats[OP_COUNT] = {
+  [OP_JP] = "JP %03X", [OP_CALL] = "CALL %03X", [OP_LD_I] = "LD I, %03X", [OP_JP_V0] = "JP V0, %03X"
+};
+
+/* Decoded as the engines decode it, so every opcode they run has its mnemonic */
+void disassemble(uint16_t opcode, char *buf, size_t size) {
+  chip8_insn in;
+
+  decode_opcode(opcode, &in);
+
+  if(plain_names[in.op] != NULL)
+    snprintf(buf, size, "%s", plain_names[in.op]);
+  else if(vx_formats[in.op] != NULL)
+    snprintf(buf, size, vx_formats[in.op], in.x);
+  else if(vx_vy_formats[in.op] != NULL)
+    snprintf(buf, size, vx_vy_formats[in.op], in.x, in.y);
+  else if(vx_nn_formats[in.op] != NULL)
+    snprintf(buf, size, vx_nn_formats[in.op], in.x, in.nn);
+  else if(nnn_formats[in.op] != NULL)
+    snprintf(buf, size, nnn_formats[in.op], in.nnn);
+  else if(in.op == OP_DRW)
+    snprintf(buf, size, "DRW V%X, V%X, %X", in.x, in.y, in.nn & 0xF);
+  else if(in.op == OP_SCD)
+    snprintf(buf, size, "SCD %X", in.nn & 0xF);
+  else if((opcode & 0xF000) == 0x0000)
+    snprintf(buf, size, "SYS %03X", in.nnn);
+  else
+    snprintf(buf, size, "Unknown opcode 0x%04X", opcode);
+}
 
 void disassembler(uint16_t opcode) {
-  switch(opcode & 0xF000) {
-    case 0x0000:
-      printw("SYS %03X", opcode & 0x0FFF);
-      break;
-    case 0x00E0:
-      printw("CLS");
-      break;
-    case 0x00EE:
-      printw("RET");
-      break;
-    case 0x1000:
-      printw("JP %03X", opcode & 0x0FFF);
-      break;
-    case 0x2000:
-      printw("CALL %03X", opcode & 0x0FFF);
-      break;
-    case 0x3000:
-      printw("SE V%X, %02X", (opcode & 0x0F00) >> 8, opcode & 0x00FF);
-      break;
-    case 0x4000:
-      printw("SNE V%X, %02X", (opcode & 0x0F00) >> 8, opcode & 0x00FF);
-      break;
-    case 0x5000:
-      printw("SE V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-      break;
-    case 0x6000:
-      printw("LD V%X, %02X", (opcode & 0x0F00) >> 8, opcode & 0x00FF);
-      break;
-    case 0x7000:
-      printw("ADD V%X, %02X", (opcode & 0x0F00) >> 8, opcode & 0x00FF);
-      break;
-    case 0x8000:
-      switch(opcode & 0x000F) {
-        case 0x0000:
-          printw("LD V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-          break;
-        case 0x0001:
-          printw("OR V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-          break;
-        case 0x0002:
-          printw("AND V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-          break;
-        case 0x0003:
-          printw("XOR V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-          break;
-        case 0x0004:
-          printw("ADD V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-          break;
-        case 0x0005:
-          printw("SUB V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-          break;
-        case 0x0006:
-          printw("SHR V%X {, V%X}", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-          break;
-        case 0x0007:
-          printw("SUBN V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-          break;
-        case 0x000E:
-          printw("SHL V%X, {, V%X}", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-          break;
-        default:
-          printw("Unknown opcode 0x%04X", opcode);
-      }
-      break;
-    case 0x9000:
-      printw("SNE V%X, V%X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4);
-      break;
-    case 0xA000:
-      printw("LD I, %03X", opcode & 0x0FFF);
-      break;
-    case 0xB000:
-      printw("JP V0, %03X", opcode & 0x0FFF);
-      break;
-    case 0xC000:
-      printw("RND V%X, %02X", (opcode & 0x0F00) >> 8, opcode & 0x0FF);
-      break;
-    case 0xD000:
-      printw("DRW V%X, V%X, %X", (opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4, opcode & 0x000F);
-      break;
-    case 0xE000:
-      switch(opcode & 0x00FF) {
-        case 0x009E:
-          printw("SKP V%X", (opcode & 0x0F00) >> 8);
-          break;
-        case 0x00A1:
-          printw("SKNP V%X", (opcode & 0x0F00) >> 8);
-          break;
-        default:
-          printw("Unknown opcode 0x%04X", opcode);
-      }
-      break;
-    case 0xF000:
-      switch(opcode & 0x00FF) {
-        case 0x0007:
-          printw("LD V%X, DT", (opcode & 0x0F00) >> 8);
-          break;
-        case 0x0015:
-          printw("LD DT, V%X", (opcode & 0x0F00) >> 8);
-          break;
-        case 0x0018:
-          printw("LD ST V%X", (opcode & 0x0F00) >> 8);
-          break;
-        case 0x001E:
-          printw("ADD I, V%X", (opcode & 0x0F00) >> 8);
-          break;
-        case 0x0029:
-          printw("LD F, V%X", (opcode & 0x0F00) >> 8);
-          break;
-        case 0x0033:
-          printw("LD B, V%X", (opcode & 0x0F00) >> 8);
-          break;
-        case 0x0055:
-          printw("LD [I], V%X", (opcode & 0x0F00) >> 8);
-          break;
-        case 0x0065:
-          printw("LD V%X, [I]", (opcode & 0x0F00) >> 8);
-          break;
-        default:
-          printw("Unknown opcode 0x%04X", opcode);
-      }
-      break;
-    default:
-      printw("Unknown opcode 0x%04X", opcode);
-  }
+  char text[DISASM_SIZE];
+
+  disassemble(opcode, text, sizeof(text));
+  printw("%s", text);
 }
 
-void mem_debugger(size_t n) {
+void mem_debugger(const chip8_t *c8, size_t n) {
   size_t i;
 
   for(i=n; i<=MEM_SIZE; i++)
-    printw("%02X ", memory[i]);
+    printw("%02X ", c8->memory[i]);
 
   addch('\n');
 }
 
 /* Views processor registers */
-void cpu_debugger(void) {
+void cpu_debugger(const dbg_snapshot *snap) {
+  const CHIP8 *cpu = &snap->cpu;
+
   attron(A_BOLD);
   addstr("Registers\n");
   attroff(A_BOLD);
 
   for(size_t i=0; i<4; i++)
-    printw("V%lX: %02X\t\tV%lX: %02X\t\tV%lX: %02X\t\tV%lX: %02X\n", i, cpu.V[i], i+0x4, cpu.V[i+0x4], i+0x8, cpu.V[i+0x8], i+0xC, cpu.V[i+0xC]);
+    printw("V%lX: %02X\t\tV%lX: %02X\t\tV%lX: %02X\t\tV%lX: %02X\n", i, cpu->V[i], i+0x4, cpu->V[i+0x4], i+0x8, cpu->V[i+0x8], i+0xC, cpu->V[i+0xC]);
 
   attron(A_BOLD);
   addstr("\nProcessor Status\n");
   attroff(A_BOLD);
 
-  printw("PC: 0x%02X\tsp: 0x%X\t\tI: 0x%02X\n", cpu.pc, cpu.sp, cpu.I);
-  printw("Cycles: %u\n", cpu.cycle_count);
+  printw("PC: 0x%02X\tsp: 0x%X\t\tI: 0x%02X\n", cpu->pc, cpu->sp, cpu->I);
+  printw("DT: %u\t\tST: %u\n", cpu->delay_timer, cpu->sound_timer);
+  printw("Cycles: %u\n", cpu->cycle_count);
 
   printw("op: ");
-  disassembler(cpu.opcode);
-  printw(" (0x%02X)", cpu.opcode);
+  disassembler(cpu->opcode);
+  printw(" (0x%02X)\n", cpu->opcode);
+}
+
+/* Views the last instructions run, oldest first */
+void history_debugger(const dbg_snapshot *snap) {
+  attron(A_BOLD);
+  addstr("\nHistory\n");
+  attroff(A_BOLD);
 
-  refresh();
-  erase();
+  for(uint32_t i=0; i<snap->n_history; i++) {
+    printw("%03X: %04X  ", snap->history[i].pc, snap->history[i].opcode);
+    disassembler(snap->history[i].opcode);
+    addch('\n');
+  }
 }
 
-void gfx_debugger(void) {
-  for(size_t i=0,j=0; i<SCREEN_WIDTH * SCREEN_HEIGHT; i++,j++) {
-    if(j == SCREEN_WIDTH) {
-      addch('\n');
-      j = 0;
+/* Engine handed out by init_debug(): one instruction at a time, remembering each */
+static int run_traced(chip8_t *c8, uint32_t max_cycles) {
+  for(uint32_t i=0; i<max_cycles; i++) {
+    dbg_trace *t = &history[history_len++ % DBG_HISTORY];
+    int status;
+
+    t->pc = c8->cpu.pc;
+    status = traced_engine(c8, 1);
+    t->opcode = c8->cpu.opcode;
+
+    if(status != CHIP8_OK)
+      return status;
+  }
+
+  return CHIP8_OK;
+}
+
+void post_snapshot(const chip8_t *c8) {
+  uint32_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+  dbg_snapshot *snap;
+  uint32_t n;
+
+  if(tail - atomic_load_explicit(&ring.head, memory_order_acquire) == DBG_RING)
+    return;
+
+  snap = &ring.slots[tail % DBG_RING];
+  snap->cpu = c8->cpu;
+  n = history_len < DBG_HISTORY ? history_len : DBG_HISTORY;
+  for(uint32_t i=0; i<n; i++)
+    snap->history[i] = history[(history_len - n + i) % DBG_HISTORY];
+  snap->n_history = n;
+
+  atomic_store_explicit(&ring.tail, tail + 1, memory_order_release);
+}
+
+/* Debugger thread: redraw from the newest snapshot at DBG_REFRESH_HZ */
+static void *dbg_main(void *arg) {
+  struct timespec period = {0, 1000000000L / DBG_REFRESH_HZ};
+  dbg_snapshot snap;
+  bool have = false;
+
+  (void)arg;
+
+  while(!atomic_load(&dbg_quit)) {
+    uint32_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+
+    /* Older snapshots are stale by now, only the last one is drawn */
+    if(head != tail) {
+      memcpy(&snap, &ring.slots[(tail - 1) % DBG_RING], sizeof(snap));
+      atomic_store_explicit(&ring.head, tail, memory_order_release);
+      have = true;
+    }
+
+    if(have) {
+      cpu_debugger(&snap);
+      history_debugger(&snap);
+      refresh();
+      erase();
     }
-    if(gfx[i] == 0)
-      addch(' ');
-    else
-      printw("%x", gfx[i]);
+
+    nanosleep(&period, NULL);
+  }
+
+  return NULL;
+}
+
+void gfx_debugger(const chip8_t *c8) {
+  int width = c8->cpu.hires ? HIRES_WIDTH : SCREEN_WIDTH, height = c8->cpu.hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+  uint32_t pixels[HIRES_WIDTH * HIRES_HEIGHT];
+  char line[HIRES_WIDTH + 2];
+
+  expand_gfx(c8->gfx, pixels, width, 0, height, '1', ' ');
+
+  /* One string per row instead of one call per pixel */
+  for(int i=0; i<height; i++) {
+    for(int j=0; j<width; j++)
+      line[j] = (char)pixels[i * width + j];
+    line[width] = i < height - 1 ? '\n' : '\0';
+    line[width + 1] = '\0';
+    addstr(line);
   }
 }
 
-/* Initialize NCurses environment */
-void init_debug(void) {
+/* Initialize NCurses environment and start the debugger thread */
+chip8_engine init_debug(chip8_engine engine) {
   initscr();
+
+  traced_engine = engine;
+  atomic_store(&dbg_quit, false);
+  dbg_running = pthread_create(&dbg_tid, NULL, dbg_main, NULL) == 0;
+
+  return run_traced;
 }
 
-/* Terminate NCurses environment */
+/* Stop the debugger thread and terminate NCurses environment */
 void free_debug(void) {
+  if(dbg_running) {
+    atomic_store(&dbg_quit, true);
+    pthread_join(dbg_tid, NULL);
+    dbg_running = false;
+  }
+
   endwin();
 }
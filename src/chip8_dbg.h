@@ -1,10 +1,45 @@
 #ifndef _CHIP8_DBG_H_
 #define _CHIP8_DBG_H_
 
-void mem_debugger(size_t n);
-void cpu_debugger(void);
-void gfx_debugger(void);
-void init_debug(void);
+#include <stddef.h>
+#include "chip8.h"
+
+/* Instructions kept in the debugger history */
+#define DBG_HISTORY 10
+
+typedef struct {
+  uint16_t pc;
+  uint16_t opcode;
+} dbg_trace;
+
+/* What the debugger thread draws: registers and the last instructions run */
+typedef struct {
+  CHIP8 cpu;
+  dbg_trace history[DBG_HISTORY];   /* Oldest first */
+  uint32_t n_history;
+} dbg_snapshot;
+
+/* Longest mnemonic disassemble() writes, with its terminator */
+#define DISASM_SIZE 32
+
+/* Write the mnemonic of opcode to buf, as shown by the debugger */
+void disassemble(uint16_t opcode, char *buf, size_t size);
+void disassembler(uint16_t opcode);
+void mem_debugger(const chip8_t *c8, size_t n);
+void cpu_debugger(const dbg_snapshot *snap);
+void history_debugger(const dbg_snapshot *snap);
+void gfx_debugger(const chip8_t *c8);
+
+/* Start ncurses and the debugger thread. Returns an engine running engine one
+* instruction at a time to record the history, to be used while debugging.
+*/
+chip8_engine init_debug(chip8_engine engine);
+
+/* Called by the emulation thread, once per frame: queue the state for the
+* debugger thread, never blocking.
+*/
+void post_snapshot(const chip8_t *c8);
+
 void free_debug(void);
 
 #endif
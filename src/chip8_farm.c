@@ -0,0 +1,450 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "chip8.h"
+#include "chip8_farm.h"
+#include "chip8_state.h"
+#include "chip8_lib.h"
+#include "chip8_sched.h"
+
+#define LINE_SIZE 1024
+
+typedef struct {
+  uint64_t cycle;
+  uint8_t key;
+  bool pressed;
+} input_event;
+
+typedef struct {
+  char *path;
+  input_event *events;
+  size_t n_events;
+} input_script;
+
+typedef struct {
+  char *path;
+  chip8_t *boot;    /* Machine right after init_chip8() and loading the ROM or save state */
+  bool state;       /* Loaded from a save state, which brings its own random numbers */
+  uint32_t ipf;     /* Recommended by the library index, the farm's otherwise */
+} rom_image;
+
+typedef struct {
+  const rom_image *rom;
+  const input_script *script;   /* NULL when the job runs without input */
+  uint64_t cycles;
+  uint32_t seed;
+  bool own_seed;                /* Seed given on the job line, otherwise the farm's */
+} farm_job;
+
+/* Why a job stopped */
+enum {
+  EXIT_BUDGET,    /* Ran the whole cycle budget        */
+  EXIT_HALT,      /* Jumped to itself, nothing changes */
+  EXIT_OPCODE,    /* Unknown opcode                    */
+  EXIT_STACK,     /* Stack overflow or underflow       */
+  EXIT_END        /* The ROM ran 00FD                  */
+};
+
+static const char *exit_names[] = {"budget", "halt", "opcode", "stack", "exit"};
+
+typedef struct {
+  uint64_t gfx_hash;
+  uint64_t cycles;
+  uint8_t exit_reason;
+} farm_result;
+
+/* Jobs still owned by a worker, as the range [head, tail) packed in one word.
+* The owner takes from the head and thieves take from the tail, both with a
+* single CAS, so there is no lock and no ABA problem as no job is ever pushed.
+* Each deque sits on its own cache line to avoid false sharing between workers.
+*/
+typedef struct {
+  _Alignas(64) _Atomic uint64_t range;
+} job_deque;
+
+typedef struct farm_s farm_t;
+
+typedef struct {
+  chip8_t machine;    /* Reused by every job this worker runs */
+  pthread_t thread;
+  int id;
+  farm_t *farm;
+} farm_worker;
+
+struct farm_s {
+  farm_job *jobs;
+  size_t n_jobs;
+  farm_result *results;
+  rom_image **roms;
+  size_t n_roms;
+  input_script **scripts;
+  size_t n_scripts;
+  job_deque *deques;
+  farm_worker *workers;
+  int n_workers;
+  chip8_engine engine;
+  uint32_t ipf;
+  uint32_t seed;        /* Every job starts its random numbers from here */
+  rom_library lib;      /* Index of --library, no entries without one */
+  size_t n_indexed;     /* ROMs found in it */
+};
+
+static uint64_t pack_range(uint32_t head, uint32_t tail) {
+  return (uint64_t)tail << 32 | head;
+}
+
+static bool pop_job(job_deque *dq, uint32_t *job) {
+  uint64_t range = atomic_load(&dq->range);
+
+  for(;;) {
+    uint32_t head = (uint32_t)range, tail = (uint32_t)(range >> 32);
+
+    if(head >= tail)
+      return false;
+
+    if(atomic_compare_exchange_weak(&dq->range, &range, pack_range(head + 1, tail))) {
+      *job = head;
+      return true;
+    }
+  }
+}
+
+static bool steal_job(job_deque *dq, uint32_t *job) {
+  uint64_t range = atomic_load(&dq->range);
+
+  for(;;) {
+    uint32_t head = (uint32_t)range, tail = (uint32_t)(range >> 32);
+
+    if(head >= tail)
+      return false;
+
+    if(atomic_compare_exchange_weak(&dq->range, &range, pack_range(head, tail - 1))) {
+      *job = tail - 1;
+      return true;
+    }
+  }
+}
+
+static void run_job(chip8_t *c8, chip8_engine engine, const farm_job *job, farm_result *res) {
+  uint32_t ipf = job->rom->ipf;
+  const input_event *events = job->script ? job->script->events : NULL;
+  size_t n_events = job->script ? job->script->n_events : 0, next = 0;
+  uint64_t cycles = 0;
+  struct chip8_jit *jit = c8->jit;
+  int status;
+
+  /* One memcpy instead of clearing memory and reading the ROM again,
+  * keeping the worker's own translated code cache, flushed for the new ROM
+  */
+  *c8 = *job->rom->boot;
+  c8->jit = jit;
+  if(jit)
+    jit_invalidate(c8, 0, MEM_SIZE);
+  if(job->own_seed)
+    seed_chip8(c8, job->seed);
+  res->exit_reason = EXIT_BUDGET;
+
+  while(cycles < job->cycles) {
+    uint16_t pc = c8->cpu.pc & MEM_MASK;
+    uint32_t before = c8->cpu.cycle_count;
+    uint64_t chunk = job->cycles - cycles;
+    uint32_t skipped;
+
+    while(next < n_events && events[next].cycle <= cycles) {
+      c8->keys[events[next].key] = events[next].pressed;
+      next++;
+    }
+
+    /* A jump to itself can never be left, nothing more to see */
+    if((c8->memory[pc] << 8 | c8->memory[(pc + 1) & MEM_MASK]) == (0x1000 | c8->cpu.pc)) {
+      res->exit_reason = EXIT_HALT;
+      break;
+    }
+
+    /* Stop at the end of the frame, and at the next input event so keys
+    * change on the right cycle
+    */
+    if(ipf - cycles % ipf < chunk)
+      chunk = ipf - cycles % ipf;
+    if(next < n_events && events[next].cycle - cycles < chunk)
+      chunk = events[next].cycle - cycles;
+
+    skipped = skip_idle(c8, (uint32_t)chunk);
+    status = skipped < chunk ? engine(c8, (uint32_t)chunk - skipped) : CHIP8_OK;
+    cycles += (uint32_t)(c8->cpu.cycle_count - before);
+
+    if(status != CHIP8_OK) {
+      res->exit_reason = status == CHIP8_BAD_STACK ? EXIT_STACK : status == CHIP8_EXIT ? EXIT_END : EXIT_OPCODE;
+      break;
+    }
+
+    if(cycles % ipf == 0)
+      tick_timers(c8);
+  }
+
+  res->cycles = cycles;
+  res->gfx_hash = hash_gfx(c8);
+}
+
+static void *worker_main(void *arg) {
+  farm_worker *w = arg;
+  farm_t *farm = w->farm;
+  uint32_t job;
+
+  for(;;) {
+    bool found = pop_job(&farm->deques[w->id], &job);
+
+    for(int i=1; !found && i<farm->n_workers; i++)
+      found = steal_job(&farm->deques[(w->id + i) % farm->n_workers], &job);
+
+    /* Jobs are never added, so once every deque is empty we are done */
+    if(!found)
+      break;
+
+    run_job(&w->machine, farm->engine, &farm->jobs[job], &farm->results[job]);
+  }
+
+  free_jit(&w->machine);
+
+  return NULL;
+}
+
+static const rom_image *get_rom(farm_t *farm, const char *path) {
+  const lib_entry *e;
+  rom_image *rom;
+  mapped_file image;
+
+  for(size_t i=0; i<farm->n_roms; i++)
+    if(strcmp(farm->roms[i]->path, path) == 0)
+      return farm->roms[i];
+
+  if(!map_file(path, &image))
+    return NULL;
+
+  rom = malloc(sizeof(rom_image));
+  rom->boot = calloc(1, sizeof(chip8_t));
+  rom->state = is_state(image.data, image.size);
+  init_chip8(rom->boot);
+  seed_chip8(rom->boot, farm->seed);
+
+  /* A save state skips the boot sequence of a ROM */
+  if(rom->state ? !load_state(rom->boot, (const chip8_state *)image.data)
+                                     : image.size == 0 || !copy_rom_image(rom->boot, image.data, image.size)) {
+    fprintf(stderr, "%s: empty, exceeds free memory or unreadable save state\n", path);
+    free(rom->boot);
+    free(rom);
+    unmap_file(&image);
+    return NULL;
+  }
+
+  /* Indexed ROMs run at the speed the library recommends, no need to analyse them here */
+  rom->ipf = farm->ipf;
+  if(!rom->state && farm->lib.count > 0 && (e = find_rom(&farm->lib, image.data, image.size)) != NULL) {
+    rom->ipf = e->ipf;
+    farm->n_indexed++;
+  }
+
+  unmap_file(&image);
+  rom->path = strdup(path);
+  farm->roms = realloc(farm->roms, (farm->n_roms + 1) * sizeof(*farm->roms));
+  farm->roms[farm->n_roms++] = rom;
+
+  return rom;
+}
+
+static const input_script *get_script(farm_t *farm, const char *path) {
+  input_script *script;
+  char line[LINE_SIZE];
+  unsigned long long cycle;
+  unsigned int key, pressed;
+  size_t cap = 0;
+  FILE *fp;
+
+  for(size_t i=0; i<farm->n_scripts; i++)
+    if(strcmp(farm->scripts[i]->path, path) == 0)
+      return farm->scripts[i];
+
+  if((fp = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "%s: file not found\n", path);
+    return NULL;
+  }
+
+  script = malloc(sizeof(input_script));
+  farm->scripts = realloc(farm->scripts, (farm->n_scripts + 1) * sizeof(*farm->scripts));
+  farm->scripts[farm->n_scripts++] = script;
+  script->path = strdup(path);
+  script->events = NULL;
+  script->n_events = 0;
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    if(line[0] == '#' || sscanf(line, "%llu %x %u", &cycle, &key, &pressed) != 3)
+      continue;
+
+    if(script->n_events == cap) {
+      cap = cap ? cap * 2 : 64;
+      script->events = realloc(script->events, cap * sizeof(input_event));
+    }
+
+    script->events[script->n_events].cycle = cycle;
+    script->events[script->n_events].key = key & 0xF;
+    script->events[script->n_events].pressed = pressed != 0;
+    script->n_events++;
+  }
+
+  fclose(fp);
+
+  return script;
+}
+
+static bool read_jobs(farm_t *farm, const char *jobs_file) {
+  char line[LINE_SIZE], rom[LINE_SIZE], script[LINE_SIZE], seed_text[LINE_SIZE], *end;
+  unsigned long long cycles, seed = 0;
+  size_t cap = 0;
+  bool with_script;
+  FILE *fp;
+  int n, line_no = 0;
+
+  if((fp = fopen(jobs_file, "r")) == NULL) {
+    fprintf(stderr, "%s: file not found\n", jobs_file);
+    return false;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    line_no++;
+    if(line[0] == '#' || (n = sscanf(line, "%1023s %llu %1023s %1023s", rom, &cycles, script, seed_text)) < 2)
+      continue;
+
+    /* Seeds are 32 bits. strtoull() would take "-1" as the largest value, so digits only */
+    if(n == 4) {
+      errno = 0;
+      seed = strtoull(seed_text, &end, 10);
+      if(seed_text[0] < '0' || seed_text[0] > '9' || *end != '\0' || errno != 0 || seed > UINT32_MAX) {
+        fprintf(stderr, "%s:%d: seed %s is not between 0 and %u\n", jobs_file, line_no, seed_text, UINT32_MAX);
+        fclose(fp);
+        return false;
+      }
+    }
+
+    /* "-" stands for no input script, so a seed can follow without one */
+    with_script = n >= 3 && strcmp(script, "-") != 0;
+
+    if(farm->n_jobs == cap) {
+      cap = cap ? cap * 2 : 256;
+      farm->jobs = realloc(farm->jobs, cap * sizeof(farm_job));
+    }
+
+    farm->jobs[farm->n_jobs].rom = get_rom(farm, rom);
+    farm->jobs[farm->n_jobs].script = with_script ? get_script(farm, script) : NULL;
+    farm->jobs[farm->n_jobs].cycles = cycles;
+    farm->jobs[farm->n_jobs].seed = n == 4 ? (uint32_t)seed : farm->seed;
+    farm->jobs[farm->n_jobs].own_seed = n == 4;
+
+    if(farm->jobs[farm->n_jobs].rom == NULL || (with_script && farm->jobs[farm->n_jobs].script == NULL)) {
+      fclose(fp);
+      return false;
+    }
+
+    farm->n_jobs++;
+  }
+
+  fclose(fp);
+
+  return true;
+}
+
+static void free_farm(farm_t *farm) {
+  for(size_t i=0; i<farm->n_roms; i++) {
+    free(farm->roms[i]->path);
+    free(farm->roms[i]->boot);
+    free(farm->roms[i]);
+  }
+
+  for(size_t i=0; i<farm->n_scripts; i++) {
+    free(farm->scripts[i]->path);
+    free(farm->scripts[i]->events);
+    free(farm->scripts[i]);
+  }
+
+  free(farm->roms);
+  free(farm->scripts);
+  free(farm->jobs);
+  free(farm->results);
+  free(farm->deques);
+  free(farm->workers);
+  close_library(&farm->lib);
+}
+
+int run_farm(const char *jobs_file, int n_threads, chip8_engine engine, uint32_t ipf, uint32_t seed,
+             const char *library) {
+  farm_t farm = {.engine = engine, .ipf = ipf, .seed = seed};
+  struct timespec start, end;
+  uint64_t total_cycles = 0;
+  double secs;
+
+  if(library != NULL && !open_library(library, &farm.lib))
+    fprintf(stderr, "No library index in %s, run --library %s first\n", library, library);
+
+  if(!read_jobs(&farm, jobs_file)) {
+    free_farm(&farm);
+    return 1;
+  }
+
+  if(n_threads <= 0)
+    n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(n_threads <= 0)
+    n_threads = 1;
+
+  farm.n_workers = n_threads;
+  farm.results = calloc(farm.n_jobs ? farm.n_jobs : 1, sizeof(farm_result));
+  farm.deques = aligned_alloc(_Alignof(job_deque), n_threads * sizeof(job_deque));
+  farm.workers = calloc(n_threads, sizeof(farm_worker));
+
+  /* Hand out contiguous slices, stealing evens out whatever is left over */
+  for(int i=0; i<n_threads; i++) {
+    size_t head = farm.n_jobs * i / n_threads, tail = farm.n_jobs * (i + 1) / n_threads;
+    atomic_init(&farm.deques[i].range, pack_range((uint32_t)head, (uint32_t)tail));
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for(int i=0; i<n_threads; i++) {
+    farm.workers[i].id = i;
+    farm.workers[i].farm = &farm;
+    pthread_create(&farm.workers[i].thread, NULL, worker_main, &farm.workers[i]);
+  }
+
+  for(int i=0; i<n_threads; i++)
+    pthread_join(farm.workers[i].thread, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+  for(size_t i=0; i<farm.n_jobs; i++) {
+    char seed_text[16] = "-";
+
+    /* A save state run without a seed of its own keeps the numbers it was saved with */
+    if(farm.jobs[i].own_seed || !farm.jobs[i].rom->state)
+      snprintf(seed_text, sizeof(seed_text), "%u", farm.jobs[i].seed);
+    printf("%zu\t%s\t%016llX\t%llu\t%s\t%s\n", i, farm.jobs[i].rom->path,
+           (unsigned long long)farm.results[i].gfx_hash,
+           (unsigned long long)farm.results[i].cycles,
+           exit_names[farm.results[i].exit_reason], seed_text);
+    total_cycles += farm.results[i].cycles;
+  }
+
+  fprintf(stderr, "%zu jobs, %llu cycles in %.3f s on %d threads (%.0f cycles/sec), seed %u\n",
+          farm.n_jobs, (unsigned long long)total_cycles, secs, n_threads,
+          secs > 0 ? (double)total_cycles / secs : 0.0, seed);
+  if(library != NULL)
+    fprintf(stderr, "%zu of %zu files found in the library of %s\n", farm.n_indexed, farm.n_roms, library);
+
+  free_farm(&farm);
+
+  return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef _CHIP8_FARM_H_
+#define _CHIP8_FARM_H_
+
+  #include "chip8.h"
+
+  /* Run every job listed in jobs_file on engine, with a pool of n_threads workers
+  * (0 means one per online CPU) and print one result line per job.
+  * Timers tick once every ipf instructions, as in a 60 Hz frame, and every
+  * job seeds its random numbers with seed unless it has one of its own, so
+  * results are reproducible.
+  *
+  * Each non-empty line of the jobs file is: rom_file cycles [input_script [seed]]
+  * where rom_file may also be a save state, and input_script may be "-" for
+  * none so a seed can be given alone.
+  * An input script holds lines of: cycle key state, where key is the hex
+  * keypad index and state is 1 for pressed or 0 for released.
+  * Lines starting with '#' are ignored in both files.
+  *
+  * With a library directory, ROMs found in its index run at the ipf it
+  * recommends for them instead of ipf. library may be NULL.
+  *
+  * Returns 0 when all jobs could be loaded, non-zero otherwise.
+  */
+  int run_farm(const char *jobs_file, int n_threads, chip8_engine engine, uint32_t ipf, uint32_t seed,
+               const char *library);
+
+#endif
@@ -0,0 +1,68 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <time.h>
+#include "chip8.h"
+#include "chip8_headless.h"
+#include "chip8_sched.h"
+
+static double elapsed_sec(const struct timespec *start, const struct timespec *end) {
+  return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_state(const chip8_t *c8) {
+  printf("PC: 0x%03X\tI: 0x%03X\tsp: 0x%X\tDT: %u\tST: %u\top: 0x%04X\n",
+         c8->cpu.pc, c8->cpu.I, c8->cpu.sp, c8->cpu.delay_timer, c8->cpu.sound_timer, c8->cpu.opcode);
+
+  for(int i=0; i<16; i++)
+    printf("V%X: %02X%c", i, c8->cpu.V[i], (i % 8 == 7) ? '\n' : ' ');
+
+  printf("gfx: %016llX\n", (unsigned long long)hash_gfx(c8));
+}
+
+int run_headless(chip8_t *c8, chip8_engine engine, uint32_t ipf, uint64_t max_cycles, uint64_t max_frames,
+                 const chip8_movie *movie) {
+  struct timespec start, end;
+  int status = CHIP8_OK;
+  uint64_t cycles = 0, frames = 0;
+  uint32_t frame_cycles = 0;
+  size_t next_event = 0;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  /* Emulated frames run back to back, a cycle limit may end the last one early */
+  while((max_cycles == 0 || cycles < max_cycles) && (max_frames == 0 || frames < max_frames)) {
+    uint32_t before = c8->cpu.cycle_count, chunk = ipf - frame_cycles, skipped;
+
+    if(movie != NULL && frame_cycles == 0)
+      play_keys(movie, &next_event, frames, c8);
+
+    if(max_cycles != 0 && max_cycles - cycles < chunk)
+      chunk = (uint32_t)(max_cycles - cycles);
+
+    skipped = skip_idle(c8, chunk);
+    status = skipped < chunk ? engine(c8, chunk - skipped) : CHIP8_OK;
+    frame_cycles += (uint32_t)(c8->cpu.cycle_count - before);
+    cycles += (uint32_t)(c8->cpu.cycle_count - before);
+
+    if(status != CHIP8_OK)
+      break;
+
+    if(frame_cycles == ipf) {
+      tick_timers(c8);
+      frame_cycles = 0;
+      frames++;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = elapsed_sec(&start, &end);
+
+  printf("Cycles: %llu\tFrames: %llu\tTime: %.3f s\t%.0f cycles/sec\n",
+         (unsigned long long)cycles, (unsigned long long)frames, secs,
+         secs > 0 ? (double)cycles / secs : 0.0);
+  print_state(c8);
+  print_status(c8, status);
+
+  return status;
+}
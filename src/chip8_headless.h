@@ -0,0 +1,18 @@
+#ifndef _CHIP8_HEADLESS_H_
+#define _CHIP8_HEADLESS_H_
+
+  #include <stdint.h>
+  #include "chip8.h"
+  #include "chip8_movie.h"
+
+  /* Run the loaded ROM on engine with no SDL or ncurses, ipf instructions per
+  * 60 Hz frame but as fast as the host allows, until max_cycles instructions or
+  * max_frames frames have been executed (0 means no limit), then print the
+  * execution speed and the final machine state to stdout.
+  * Keys follow movie frame by frame, unless it is NULL.
+  * Returns the emulate_cycle() status the run ended with.
+  */
+  int run_headless(chip8_t *c8, chip8_engine engine, uint32_t ipf, uint64_t max_cycles, uint64_t max_frames,
+                   const chip8_movie *movie);
+
+#endif
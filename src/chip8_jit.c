@@ -0,0 +1,751 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "chip8.h"
+
+/* Dynamic recompiler for x86-64 Linux.
+*
+* Straight-line runs of register instructions are translated into native
+* code, up to a block terminator: 1NNN, 2NNN, 00EE, BNNN or a skip. Exits
+* with a known target are chained straight to the next block once it exists.
+* DXYN, 00E0, FX0A, FX33, FX55 and unknown opcodes are never translated,
+* the dispatcher runs them with the pre-decoded engine instead.
+*
+* Native code keeps the machine in rbx and the remaining instruction budget
+* in r12d. Every instruction is guarded by a budget check leaving the block
+* right before it, so blocks longer than a frame's budget still run natively,
+* and every exit accounts for the instructions it ran in cycle_count and
+* opcode, so the machine state stays identical to emulate_cycle() whenever
+* native code hands back to the dispatcher.
+*
+* FX33/FX55 writes reach jit_invalidate() through invalidate_decoded(): the
+* blocks covering the written bytes get their entry patched into an exit, and
+* an address whose code keeps being rewritten is left to the interpreter.
+* Chained exits stay linked to their target address, so the block translated
+* again there takes over the predecessors of the one it replaces.
+*/
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+#define CODE_SIZE       (4 * 1024 * 1024)
+#define MAX_BLOCK_INSNS 32
+#define MAX_BLOCK_BYTES (MAX_BLOCK_INSNS * 704)   /* Worst case is 16 FX65 loads, plus guards */
+#define MAX_BLOCKS      4096
+#define MAX_LINKS       (2 * MAX_BLOCKS)
+#define SMC_LIMIT       8
+
+/* x86 registers used by the translated code */
+#define EAX 0
+#define ECX 1
+#define EDX 2
+
+/* Offsets of the machine state from rbx */
+#define OFF_V(x)    (offsetof(chip8_t, cpu.V) + (x))
+#define OFF_I       offsetof(chip8_t, cpu.I)
+#define OFF_PC      offsetof(chip8_t, cpu.pc)
+#define OFF_SP      offsetof(chip8_t, cpu.sp)
+#define OFF_STACK   offsetof(chip8_t, cpu.stack)
+#define OFF_OPCODE  offsetof(chip8_t, cpu.opcode)
+#define OFF_CYCLES  offsetof(chip8_t, cpu.cycle_count)
+#define OFF_RNG     offsetof(chip8_t, cpu.rng)
+#define OFF_DT      offsetof(chip8_t, cpu.delay_timer)
+#define OFF_ST      offsetof(chip8_t, cpu.sound_timer)
+#define OFF_KEYS    offsetof(chip8_t, keys)
+#define OFF_MEMORY  offsetof(chip8_t, memory)
+
+typedef int32_t (*jit_entry)(chip8_t *c8, int32_t budget, uint8_t *block);
+
+typedef struct {
+  uint8_t *code;    /* Entry point in the code cache */
+  uint16_t start;
+  uint16_t end;     /* First byte after the block */
+  bool live;
+} jit_block;
+
+/* A chainable exit, jumping to the block at its target or to the dispatcher */
+typedef struct {
+  uint32_t patch;   /* Offset of the jmp rel32 in the code cache */
+  int32_t next;     /* Next link waiting on the same address, -1 ends the list */
+} jit_link;
+
+struct chip8_jit {
+  uint8_t *code;
+  uint8_t *p;                     /* Next free byte of the code cache */
+  uint8_t *first;                 /* First byte after the prologue and epilogue */
+  uint8_t *exit;                  /* Epilogue returning the budget left */
+  jit_entry enter;
+  jit_block *block_at[MEM_SIZE];
+  jit_block blocks[MAX_BLOCKS];
+  int n_blocks;
+  jit_link links[MAX_LINKS];
+  int n_links;
+  int32_t waiting[MEM_SIZE];      /* First link of the exits going to this address */
+  uint16_t covered[MEM_SIZE];     /* Live blocks covering each byte */
+  uint8_t rewrites[MEM_SIZE];     /* Times a block starting here was written over */
+  bool nojit[MEM_SIZE];           /* First instruction here can't be translated */
+  bool failed;                    /* No executable memory, interpret everything */
+};
+
+/* Budget check before an instruction, jumping out of line to its exit */
+typedef struct {
+  uint32_t patch;     /* Offset of the jle rel32 in the code cache */
+  uint16_t addr;      /* Of the instruction it guards */
+  uint16_t last_op;   /* Opcode of the one before */
+  int n;              /* Instructions run before it */
+} jit_guard;
+
+/* State of the block being translated */
+typedef struct {
+  struct chip8_jit *jit;
+  uint16_t last_op;   /* Opcode of the last instruction translated */
+  uint16_t prev_op;   /* Opcode of the one before, for exits before the terminator */
+  jit_guard guards[MAX_BLOCK_INSNS];
+  int n_guards;
+} jit_ctx;
+
+static void emit8(struct chip8_jit *jit, uint8_t b) {
+  *jit->p++ = b;
+}
+
+static void emit16(struct chip8_jit *jit, uint16_t v) {
+  emit8(jit, v & 0xFF);
+  emit8(jit, v >> 8);
+}
+
+static void emit32(struct chip8_jit *jit, uint32_t v) {
+  emit16(jit, v & 0xFFFF);
+  emit16(jit, v >> 16);
+}
+
+static void emit_bytes(struct chip8_jit *jit, const uint8_t *bytes, size_t n) {
+  memcpy(jit->p, bytes, n);
+  jit->p += n;
+}
+
+#define EMIT(jit, ...) do { static const uint8_t b_[] = {__VA_ARGS__}; emit_bytes(jit, b_, sizeof(b_)); } while(0)
+
+/* ModRM for [rbx + disp32] */
+static void emit_rbx(struct chip8_jit *jit, int reg, size_t off) {
+  emit8(jit, 0x83 | reg << 3);
+  emit32(jit, (uint32_t)off);
+}
+
+/* movzx reg, byte [rbx + off] */
+static void load8(struct chip8_jit *jit, int reg, size_t off) {
+  EMIT(jit, 0x0F, 0xB6);
+  emit_rbx(jit, reg, off);
+}
+
+/* mov byte [rbx + off], reg8 */
+static void store8(struct chip8_jit *jit, int reg, size_t off) {
+  emit8(jit, 0x88);
+  emit_rbx(jit, reg, off);
+}
+
+/* mov byte [rbx + off], imm8 */
+static void store8_imm(struct chip8_jit *jit, size_t off, uint8_t imm) {
+  emit8(jit, 0xC6);
+  emit_rbx(jit, 0, off);
+  emit8(jit, imm);
+}
+
+/* movzx reg, word [rbx + off] */
+static void load16(struct chip8_jit *jit, int reg, size_t off) {
+  EMIT(jit, 0x0F, 0xB7);
+  emit_rbx(jit, reg, off);
+}
+
+/* mov word [rbx + off], reg16 */
+static void store16(struct chip8_jit *jit, int reg, size_t off) {
+  EMIT(jit, 0x66, 0x89);
+  emit_rbx(jit, reg, off);
+}
+
+/* mov word [rbx + off], imm16 */
+static void store16_imm(struct chip8_jit *jit, size_t off, uint16_t imm) {
+  EMIT(jit, 0x66, 0xC7);
+  emit_rbx(jit, 0, off);
+  emit16(jit, imm);
+}
+
+/* jcc/jmp rel32 to target, or left for patching when target is NULL.
+* Returns the offset of the rel32 in the code cache.
+*/
+static uint32_t emit_jump(struct chip8_jit *jit, const uint8_t *op, size_t op_len, const uint8_t *target) {
+  uint32_t patch;
+
+  emit_bytes(jit, op, op_len);
+  patch = (uint32_t)(jit->p - jit->code);
+  emit32(jit, target ? (uint32_t)(target - (jit->p + 4)) : 0);
+
+  return patch;
+}
+
+static void patch_jump(struct chip8_jit *jit, uint32_t patch, const uint8_t *target) {
+  int32_t rel = (int32_t)(target - (jit->code + patch + 4));
+  memcpy(jit->code + patch, &rel, 4);
+}
+
+static uint32_t jmp(struct chip8_jit *jit, const uint8_t *target) {
+  static const uint8_t op[] = {0xE9};
+  return emit_jump(jit, op, sizeof(op), target);
+}
+
+static uint32_t jcc(struct chip8_jit *jit, uint8_t cc, const uint8_t *target) {
+  const uint8_t op[] = {0x0F, cc};
+  return emit_jump(jit, op, sizeof(op), target);
+}
+
+#define JE  0x84
+#define JNE 0x85
+#define JLE 0x8E
+
+/* Account for the n instructions run before leaving the block */
+static void emit_accounting(jit_ctx *ctx, int n) {
+  struct chip8_jit *jit = ctx->jit;
+
+  if(n == 0)
+    return;
+
+  store16_imm(jit, OFF_OPCODE, ctx->last_op);
+  emit8(jit, 0x81);                       /* add dword [rbx + cycles], n */
+  emit_rbx(jit, 0, OFF_CYCLES);
+  emit32(jit, (uint32_t)n);
+  EMIT(jit, 0x41, 0x81, 0xEC);            /* sub r12d, n */
+  emit32(jit, (uint32_t)n);
+}
+
+/* Leave the block towards a known address, chaining to its block when possible */
+static void exit_to(jit_ctx *ctx, int n, uint16_t target) {
+  struct chip8_jit *jit = ctx->jit;
+  jit_block *b = target < MEM_SIZE - 1 ? jit->block_at[target] : NULL;
+  uint32_t patch;
+
+  emit_accounting(ctx, n);
+  store16_imm(jit, OFF_PC, target);
+
+  patch = jmp(jit, b ? b->code : jit->exit);
+  if(target < MEM_SIZE - 1 && !jit->nojit[target] && jit->n_links < MAX_LINKS) {
+    jit->links[jit->n_links].patch = patch;
+    jit->links[jit->n_links].next = jit->waiting[target];
+    jit->waiting[target] = jit->n_links++;
+  }
+}
+
+/* Leave the block once the instruction already stored PC itself */
+static void exit_dynamic(jit_ctx *ctx, int n) {
+  emit_accounting(ctx, n);
+  jmp(ctx->jit, ctx->jit->exit);
+}
+
+/* Leave the block before the instruction at addr, for the interpreter to run it */
+static void exit_before(jit_ctx *ctx, int n, uint16_t addr) {
+  emit_accounting(ctx, n);
+  store16_imm(ctx->jit, OFF_PC, addr);
+  jmp(ctx->jit, ctx->jit->exit);
+}
+
+/* Leave before the instruction at addr, n instructions into the block, when
+* the budget doesn't cover it. The exit itself goes after the block.
+*/
+static void emit_guard(jit_ctx *ctx, int n, uint16_t addr) {
+  struct chip8_jit *jit = ctx->jit;
+  jit_guard *g;
+
+  /* Nothing to account for yet, the dispatcher or the previous block stored PC */
+  if(n == 0) {
+    EMIT(jit, 0x45, 0x85, 0xE4);          /* test r12d, r12d; jle exit */
+    jcc(jit, JLE, jit->exit);
+    return;
+  }
+
+  EMIT(jit, 0x41, 0x83, 0xFC);            /* cmp r12d, n; jle guard exit */
+  emit8(jit, (uint8_t)n);
+  g = &ctx->guards[ctx->n_guards++];
+  g->patch = jcc(jit, JLE, NULL);
+  g->addr = addr;
+  g->last_op = ctx->last_op;
+  g->n = n;
+}
+
+/* Conditional skip: flags already set, cc jumps when the next instruction is skipped */
+static void exit_skip(jit_ctx *ctx, int n, uint8_t cc, uint16_t addr) {
+  uint32_t taken = jcc(ctx->jit, cc, NULL);
+
+  exit_to(ctx, n, addr + 2);
+  patch_jump(ctx->jit, taken, ctx->jit->p);
+  exit_to(ctx, n, addr + 4);
+}
+
+/* Translate one straight-line instruction, false if it can't be */
+static bool emit_insn(jit_ctx *ctx, const chip8_insn *in) {
+  struct chip8_jit *jit = ctx->jit;
+  int x = in->x, y = in->y;
+
+  switch(in->op) {
+    case OP_LD_NN:
+      store8_imm(jit, OFF_V(x), in->nn);
+      break;
+    case OP_ADD_NN:
+      emit8(jit, 0x80);                   /* add byte [rbx + Vx], nn */
+      emit_rbx(jit, 0, OFF_V(x));
+      emit8(jit, in->nn);
+      break;
+    case OP_LD_VY:
+      load8(jit, EAX, OFF_V(y));
+      store8(jit, EAX, OFF_V(x));
+      break;
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+      load8(jit, EAX, OFF_V(x));
+      load8(jit, ECX, OFF_V(y));
+      emit8(jit, in->op == OP_OR ? 0x08 : in->op == OP_AND ? 0x20 : 0x30);
+      emit8(jit, 0xC8);                   /* or/and/xor al, cl */
+      store8(jit, EAX, OFF_V(x));
+      break;
+    /* The arithmetic below writes VF first and then reloads VX and VY,
+    * exactly like emulate_cycle(), for when X or Y is F.
+    */
+    case OP_ADD_VY:
+    case OP_SUB:
+    case OP_SUBN:
+      load8(jit, EAX, OFF_V(x));
+      load8(jit, ECX, OFF_V(y));
+      if(in->op == OP_ADD_VY)
+        EMIT(jit, 0x00, 0xC8, 0x0F, 0x92, 0xC2);    /* add al, cl; setc dl  */
+      else if(in->op == OP_SUB)
+        EMIT(jit, 0x38, 0xC8, 0x0F, 0x97, 0xC2);    /* cmp al, cl; seta dl  */
+      else
+        EMIT(jit, 0x38, 0xC8, 0x0F, 0x96, 0xC2);    /* cmp al, cl; setbe dl */
+      store8(jit, EDX, OFF_V(0xF));
+      load8(jit, EAX, OFF_V(x));
+      load8(jit, ECX, OFF_V(y));
+      if(in->op == OP_ADD_VY)
+        EMIT(jit, 0x00, 0xC8);                      /* add al, cl */
+      else if(in->op == OP_SUB)
+        EMIT(jit, 0x28, 0xC8);                      /* sub al, cl */
+      else
+        EMIT(jit, 0x28, 0xC1, 0x88, 0xC8);          /* sub cl, al; mov al, cl */
+      store8(jit, EAX, OFF_V(x));
+      break;
+    case OP_SHR:
+    case OP_SHL:
+      load8(jit, EAX, OFF_V(x));
+      if(in->op == OP_SHR)
+        EMIT(jit, 0x24, 0x01);                      /* and al, 1    */
+      else
+        EMIT(jit, 0xC0, 0xE8, 0x07);                /* shr al, 7    */
+      store8(jit, EAX, OFF_V(0xF));
+      load8(jit, EAX, OFF_V(x));
+      if(in->op == OP_SHR)
+        EMIT(jit, 0xD0, 0xE8);                      /* shr al, 1    */
+      else
+        EMIT(jit, 0xD0, 0xE0);                      /* shl al, 1    */
+      store8(jit, EAX, OFF_V(x));
+      break;
+    case OP_LD_I:
+      store16_imm(jit, OFF_I, in->nnn);
+      break;
+    case OP_RND:
+      /* Inline random_byte() */
+      emit8(jit, 0x8B);                             /* mov eax, [rbx + rng] */
+      emit_rbx(jit, EAX, OFF_RNG);
+      EMIT(jit, 0x89, 0xC1, 0xC1, 0xE1, 0x0D,       /* mov ecx, eax; shl ecx, 13 */
+           0x31, 0xC8,                              /* xor eax, ecx */
+           0x89, 0xC1, 0xC1, 0xE9, 0x11,            /* mov ecx, eax; shr ecx, 17 */
+           0x31, 0xC8,                              /* xor eax, ecx */
+           0x89, 0xC1, 0xC1, 0xE1, 0x05,            /* mov ecx, eax; shl ecx, 5 */
+           0x31, 0xC8);                             /* xor eax, ecx */
+      emit8(jit, 0x89);                             /* mov [rbx + rng], eax */
+      emit_rbx(jit, EAX, OFF_RNG);
+      EMIT(jit, 0xC1, 0xE8, 0x18, 0x24);            /* shr eax, 24; and al, nn */
+      emit8(jit, in->nn);
+      store8(jit, EAX, OFF_V(x));
+      break;
+    case OP_LD_VX_DT:
+      load8(jit, EAX, OFF_DT);
+      store8(jit, EAX, OFF_V(x));
+      break;
+    case OP_LD_DT_VX:
+    case OP_LD_ST:
+      load8(jit, EAX, OFF_V(x));
+      store8(jit, EAX, in->op == OP_LD_DT_VX ? OFF_DT : OFF_ST);
+      break;
+    case OP_ADD_I:
+      load16(jit, EAX, OFF_I);
+      load8(jit, ECX, OFF_V(x));
+      EMIT(jit, 0x01, 0xC8, 0x3D);                  /* add eax, ecx; cmp eax, 0xFFF */
+      emit32(jit, 0xFFF);
+      EMIT(jit, 0x0F, 0x97, 0xC2);                  /* seta dl */
+      store8(jit, EDX, OFF_V(0xF));
+      load16(jit, EAX, OFF_I);
+      load8(jit, ECX, OFF_V(x));
+      EMIT(jit, 0x01, 0xC8);                        /* add eax, ecx */
+      store16(jit, EAX, OFF_I);
+      break;
+    case OP_LD_F:
+      /* The font digits are 5 bytes apart from 0x050, as in sprite_addr */
+      load8(jit, EAX, OFF_V(x));
+      EMIT(jit, 0x83, 0xE0, 0x0F, 0x6B, 0xC0, 0x05, 0x83, 0xC0, 0x50);  /* and eax, 15; imul eax, eax, 5; add eax, 0x50 */
+      store16(jit, EAX, OFF_I);
+      break;
+    case OP_LD_VX_I:
+      for(int i=0; i<=x; i++) {
+        load16(jit, EAX, OFF_I);
+        EMIT(jit, 0x05);                            /* add eax, i     */
+        emit32(jit, (uint32_t)i);
+        EMIT(jit, 0x25);                            /* and eax, 0xFFF */
+        emit32(jit, MEM_MASK);
+        EMIT(jit, 0x0F, 0xB6, 0x8C, 0x03);          /* movzx ecx, byte [rbx + rax + memory] */
+        emit32(jit, (uint32_t)OFF_MEMORY);
+        store8(jit, ECX, OFF_V(i));
+      }
+      load16(jit, EAX, OFF_I);
+      load8(jit, ECX, OFF_V(x));
+      EMIT(jit, 0x01, 0xC8, 0x83, 0xC0, 0x01);      /* add eax, ecx; add eax, 1 */
+      store16(jit, EAX, OFF_I);
+      break;
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+/* Translate a block terminator ending the block with n instructions, false if it isn't one */
+static bool emit_terminator(jit_ctx *ctx, const chip8_insn *in, uint16_t addr, int n) {
+  struct chip8_jit *jit = ctx->jit;
+  uint32_t fail;
+
+  switch(in->op) {
+    case OP_JP:
+      exit_to(ctx, n, in->nnn);
+      break;
+    case OP_CALL:
+      load8(jit, EAX, OFF_SP);
+      EMIT(jit, 0x3C, 0x10);                        /* cmp al, 16 */
+      fail = jcc(jit, JE, NULL);
+      EMIT(jit, 0xB9);                              /* mov ecx, addr */
+      emit32(jit, addr);
+      EMIT(jit, 0x66, 0x89, 0x8C, 0x43);            /* mov word [rbx + rax*2 + stack], cx */
+      emit32(jit, (uint32_t)OFF_STACK);
+      emit8(jit, 0xFE);                             /* inc byte [rbx + sp] */
+      emit_rbx(jit, 0, OFF_SP);
+      exit_to(ctx, n, in->nnn);
+      /* Overflow: leave it to the interpreter to report */
+      patch_jump(jit, fail, jit->p);
+      ctx->last_op = ctx->prev_op;
+      exit_before(ctx, n - 1, addr);
+      break;
+    case OP_RET:
+      load8(jit, EAX, OFF_SP);
+      EMIT(jit, 0x84, 0xC0);                        /* test al, al */
+      fail = jcc(jit, JE, NULL);
+      EMIT(jit, 0x2C, 0x01);                        /* sub al, 1   */
+      store8(jit, EAX, OFF_SP);
+      EMIT(jit, 0x0F, 0xB6, 0xC0);                  /* movzx eax, al */
+      EMIT(jit, 0x0F, 0xB7, 0x84, 0x43);            /* movzx eax, word [rbx + rax*2 + stack] */
+      emit32(jit, (uint32_t)OFF_STACK);
+      EMIT(jit, 0x83, 0xC0, 0x02);                  /* add eax, 2 */
+      store16(jit, EAX, OFF_PC);
+      exit_dynamic(ctx, n);
+      patch_jump(jit, fail, jit->p);
+      ctx->last_op = ctx->prev_op;
+      exit_before(ctx, n - 1, addr);
+      break;
+    case OP_JP_V0:
+      load8(jit, EAX, OFF_V(0));
+      EMIT(jit, 0x05);                              /* add eax, nnn */
+      emit32(jit, in->nnn);
+      store16(jit, EAX, OFF_PC);
+      exit_dynamic(ctx, n);
+      break;
+    case OP_SE_NN:
+    case OP_SNE_NN:
+      emit8(jit, 0x80);                             /* cmp byte [rbx + Vx], nn */
+      emit_rbx(jit, 7, OFF_V(in->x));
+      emit8(jit, in->nn);
+      exit_skip(ctx, n, in->op == OP_SE_NN ? JE : JNE, addr);
+      break;
+    case OP_SE_VY:
+    case OP_SNE_VY:
+      load8(jit, EAX, OFF_V(in->x));
+      emit8(jit, 0x3A);                             /* cmp al, byte [rbx + Vy] */
+      emit_rbx(jit, EAX, OFF_V(in->y));
+      exit_skip(ctx, n, in->op == OP_SE_VY ? JE : JNE, addr);
+      break;
+    case OP_SKP:
+    case OP_SKNP:
+      load8(jit, EAX, OFF_V(in->x));
+      EMIT(jit, 0x83, 0xE0, 0x0F);                  /* and eax, 15 */
+      EMIT(jit, 0x80, 0xBC, 0x03);                  /* cmp byte [rbx + rax + keys], 0 */
+      emit32(jit, (uint32_t)OFF_KEYS);
+      emit8(jit, 0);
+      exit_skip(ctx, n, in->op == OP_SKP ? JNE : JE, addr);
+      break;
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+static void flush_jit(struct chip8_jit *jit) {
+  jit->p = jit->first;
+  jit->n_blocks = 0;
+  jit->n_links = 0;
+  memset(jit->block_at, 0, sizeof(jit->block_at));
+  memset(jit->covered, 0, sizeof(jit->covered));
+  memset(jit->nojit, 0, sizeof(jit->nojit));
+  memset(jit->rewrites, 0, sizeof(jit->rewrites));
+  memset(jit->waiting, 0xFF, sizeof(jit->waiting));
+}
+
+/* Translate the block starting at start, NULL when its first instruction can't be */
+static jit_block *translate(chip8_t *c8, uint16_t start) {
+  struct chip8_jit *jit = c8->jit;
+  jit_ctx ctx = {.jit = jit};
+  jit_block *b;
+  uint8_t *entry;
+  uint16_t addr = start;
+  int n = 0;
+
+  if(jit->rewrites[start] >= SMC_LIMIT) {
+    jit->nojit[start] = true;
+    return NULL;
+  }
+
+  if(jit->n_blocks == MAX_BLOCKS || jit->n_links > MAX_LINKS - 2 * MAX_BLOCK_INSNS
+     || (size_t)(jit->code + CODE_SIZE - jit->p) < MAX_BLOCK_BYTES)
+    flush_jit(jit);
+
+  entry = jit->p;
+  emit_guard(&ctx, 0, start);
+
+  for(;;) {
+    uint8_t *guard = jit->p;
+    chip8_insn in;
+
+    if(addr >= MEM_SIZE - 1 || n == MAX_BLOCK_INSNS) {
+      exit_to(&ctx, n, addr);
+      break;
+    }
+
+    decode_opcode(c8->memory[addr] << 8 | c8->memory[addr + 1], &in);
+    if(n > 0)
+      emit_guard(&ctx, n, addr);
+
+    if(emit_insn(&ctx, &in)) {
+      ctx.last_op = in.opcode;
+      n++;
+      addr += 2;
+      continue;
+    }
+
+    ctx.prev_op = ctx.last_op;
+    ctx.last_op = in.opcode;
+    if(emit_terminator(&ctx, &in, addr, n + 1)) {
+      n++;
+      addr += 2;
+      break;
+    }
+
+    /* Left to the interpreter, which makes the guard before it useless */
+    ctx.last_op = ctx.prev_op;
+    if(n > 0) {
+      jit->p = guard;
+      ctx.n_guards--;
+    }
+    if(n == 0) {
+      jit->p = entry;
+      jit->nojit[start] = true;
+      return NULL;
+    }
+
+    exit_before(&ctx, n, addr);
+    break;
+  }
+
+  for(int i=0; i<ctx.n_guards; i++) {
+    patch_jump(jit, ctx.guards[i].patch, jit->p);
+    ctx.last_op = ctx.guards[i].last_op;
+    exit_before(&ctx, ctx.guards[i].n, ctx.guards[i].addr);
+  }
+
+  b = &jit->blocks[jit->n_blocks++];
+  b->code = entry;
+  b->start = start;
+  b->end = addr;
+  b->live = true;
+  jit->block_at[start] = b;
+
+  for(uint16_t i=start; i<addr; i++)
+    jit->covered[i]++;
+
+  /* Chain the exits going here, those of an invalidated block's predecessors too */
+  for(int32_t l=jit->waiting[start]; l>=0; l=jit->links[l].next)
+    patch_jump(jit, jit->links[l].patch, entry);
+
+  return b;
+}
+
+/* Stands in for a recompiler that could not be allocated, shared by every machine */
+static struct chip8_jit no_jit = { .failed = true };
+
+static struct chip8_jit *create_jit(void) {
+  struct chip8_jit *jit = calloc(1, sizeof(struct chip8_jit));
+
+  if(jit == NULL)
+    return &no_jit;
+
+  jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(jit->code == MAP_FAILED) {
+    jit->code = NULL;
+    jit->failed = true;
+    return jit;
+  }
+
+  /* int32_t enter(chip8_t *c8, int32_t budget, uint8_t *block) */
+  jit->p = jit->code;
+  EMIT(jit, 0x53, 0x41, 0x54);            /* push rbx; push r12 */
+  EMIT(jit, 0x48, 0x89, 0xFB);            /* mov rbx, rdi       */
+  EMIT(jit, 0x41, 0x89, 0xF4);            /* mov r12d, esi      */
+  EMIT(jit, 0xFF, 0xE2);                  /* jmp rdx            */
+
+  jit->exit = jit->p;
+  EMIT(jit, 0x44, 0x89, 0xE0);            /* mov eax, r12d      */
+  EMIT(jit, 0x41, 0x5C, 0x5B, 0xC3);      /* pop r12; pop rbx; ret */
+
+  jit->first = jit->p;
+  memcpy(&jit->enter, &jit->code, sizeof(jit->enter));
+  flush_jit(jit);
+
+  return jit;
+}
+
+void jit_invalidate(chip8_t *c8, uint16_t addr, size_t len) {
+  struct chip8_jit *jit = c8->jit;
+  bool hit = false;
+
+  if(jit == NULL || jit->failed)
+    return;
+
+  if(len >= MEM_SIZE) {
+    flush_jit(jit);
+    return;
+  }
+
+  for(size_t i=0; i<len; i++) {
+    uint16_t a = (addr + i) & MEM_MASK;
+
+    hit |= jit->covered[a] != 0;
+    jit->nojit[a] = false;
+    jit->nojit[(a - 1) & MEM_MASK] = false;
+  }
+
+  if(!hit)
+    return;
+
+  for(int i=0; i<jit->n_blocks; i++) {
+    jit_block *b = &jit->blocks[i];
+    uint8_t *p = jit->p;
+    bool overlap = false;
+
+    for(size_t j=0; j<len && !overlap; j++) {
+      uint16_t a = (addr + j) & MEM_MASK;
+      overlap = a >= b->start && a < b->end;
+    }
+
+    if(!b->live || !overlap)
+      continue;
+
+    /* Chained predecessors already stored PC, so the entry just has to leave */
+    jit->p = b->code;
+    jmp(jit, jit->exit);
+    jit->p = p;
+
+    b->live = false;
+    jit->block_at[b->start] = NULL;
+    if(jit->rewrites[b->start] < SMC_LIMIT)
+      jit->rewrites[b->start]++;
+    for(uint16_t a=b->start; a<b->end; a++)
+      jit->covered[a]--;
+  }
+}
+
+int run_jit(chip8_t *c8, uint32_t max_cycles) {
+  struct chip8_jit *jit = c8->jit;
+
+  if(jit == NULL)
+    jit = c8->jit = create_jit();
+
+  if(jit->failed)
+    return run_cached(c8, max_cycles);
+
+  while(max_cycles > 0) {
+    int32_t budget = max_cycles > INT32_MAX ? INT32_MAX : (int32_t)max_cycles;
+    uint16_t pc = c8->cpu.pc;
+    jit_block *b = NULL;
+    int32_t left;
+    int status;
+
+    if(pc < MEM_SIZE - 1 && !jit->nojit[pc])
+      b = jit->block_at[pc] ? jit->block_at[pc] : translate(c8, pc);
+
+    if(b == NULL) {
+      if((status = run_cached(c8, 1)) != CHIP8_OK)
+        return status;
+      max_cycles--;
+
+      /* FX0A without a key: keys can't change before we return, so keep waiting */
+      if(c8->cpu.pc == pc)
+        return run_cached(c8, max_cycles);
+      continue;
+    }
+
+    left = jit->enter(c8, budget, b->code);
+
+    /* A stack error for the interpreter to report */
+    if(left == budget)
+      return run_cached(c8, max_cycles);
+
+    max_cycles -= (uint32_t)(budget - left);
+  }
+
+  return CHIP8_OK;
+}
+
+void free_jit(chip8_t *c8) {
+  if(c8->jit == NULL)
+    return;
+
+  if(c8->jit == &no_jit) {
+    c8->jit = NULL;
+    return;
+  }
+
+  if(c8->jit->code)
+    munmap(c8->jit->code, CODE_SIZE);
+  free(c8->jit);
+  c8->jit = NULL;
+}
+
+#else
+
+/* No recompiler on this platform, the pre-decoded engine does the work */
+int run_jit(chip8_t *c8, uint32_t max_cycles) {
+  return run_cached(c8, max_cycles);
+}
+
+void jit_invalidate(chip8_t *c8, uint16_t addr, size_t len) {
+}
+
+void free_jit(chip8_t *c8) {
+}
+
+#endif
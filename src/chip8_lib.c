@@ -0,0 +1,306 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chip8.h"
+#include "chip8_lib.h"
+#include "chip8_cfg.h"
+#include "chip8_sched.h"
+#include "chip8_state.h"
+
+/* ROM library.
+*
+* A ROM is analysed once: its hash, size, the instructions reachable from
+* PRG_ADDR, the platform they need and the settings that suit it go into an
+* index in the library directory. Launching a ROM then only hashes the mapped
+* image to find them, and rescanning only reads files that changed.
+*/
+
+_Static_assert(sizeof(lib_header) == 32 && sizeof(lib_entry) % 8 == 0,
+               "lib_header and lib_entry must have no padding");
+
+static const char *platform_names[] = {"CHIP-8", "SCHIP"};
+
+const char *platform_name(uint8_t platform) {
+  return platform < sizeof(platform_names) / sizeof(platform_names[0]) ? platform_names[platform] : "?";
+}
+
+bool map_file(const char *path, mapped_file *mf) {
+  struct stat sb;
+  void *map;
+  int fd;
+
+  mf->data = NULL;
+  mf->size = 0;
+
+  if((fd = open(path, O_RDONLY)) < 0) {
+    perror(path);
+    return false;
+  }
+
+  if(fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+    close(fd);
+    fprintf(stderr, "%s: not a regular file\n", path);
+    return false;
+  }
+
+  /* mmap() refuses empty mappings, an empty file is just no data */
+  if(sb.st_size > 0) {
+    map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) {
+      perror(path);
+      close(fd);
+      return false;
+    }
+    mf->data = map;
+    mf->size = (size_t)sb.st_size;
+  }
+
+  close(fd);
+
+  return true;
+}
+
+void unmap_file(mapped_file *mf) {
+  if(mf->data != NULL)
+    munmap((void *)mf->data, mf->size);
+  mf->data = NULL;
+  mf->size = 0;
+}
+
+/* FNV-1a, as hash_gfx() */
+uint64_t hash_rom(const uint8_t *image, size_t size) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  for(size_t i=0; i<size; i++) {
+    hash ^= image[i];
+    hash *= 0x100000001B3ULL;
+  }
+
+  return hash;
+}
+
+void analyse_rom(const uint8_t *image, size_t size, lib_entry *e) {
+  uint8_t memory[MEM_SIZE] = {0};
+  bool schip;
+
+  if(size > FREE_MEM)
+    size = FREE_MEM;
+  memcpy(memory + PRG_ADDR, image, size);
+
+  e->hash = hash_rom(image, size);
+  e->size = (uint32_t)size;
+  e->n_reachable = find_code(memory, e->reachable, &schip);
+  e->platform = schip ? PLATFORM_SCHIP : PLATFORM_CHIP8;
+  e->ipf = schip ? SCHIP_IPF : DEFAULT_IPF;
+  memset(e->reserved, 0, sizeof(e->reserved));
+}
+
+static bool valid_index(const mapped_file *mf) {
+  const lib_header *h = (const lib_header *)mf->data;
+
+  return mf->size >= sizeof(lib_header)
+         && memcmp(h->magic, LIB_MAGIC, sizeof(h->magic)) == 0
+         && h->version == LIB_VERSION && h->entry_size == sizeof(lib_entry)
+         && mf->size == sizeof(lib_header) + (size_t)h->count * sizeof(lib_entry);
+}
+
+static char *index_path(const char *dir) {
+  char *path = malloc(strlen(dir) + sizeof("/" LIB_INDEX));
+
+  strcpy(path, dir);
+  strcat(path, "/" LIB_INDEX);
+
+  return path;
+}
+
+bool open_library(const char *dir, rom_library *lib) {
+  char *path = index_path(dir);
+  struct stat sb;
+  bool ok = false;
+
+  lib->entries = NULL;
+  lib->count = 0;
+  lib->file.data = NULL;
+  lib->file.size = 0;
+
+  /* No index yet is not an error worth a message */
+  if(stat(path, &sb) == 0 && map_file(path, &lib->file)) {
+    if((ok = valid_index(&lib->file))) {
+      lib->count = ((const lib_header *)lib->file.data)->count;
+      lib->entries = (const lib_entry *)(lib->file.data + sizeof(lib_header));
+    } else {
+      fprintf(stderr, "%s: not a library index of this version\n", path);
+      unmap_file(&lib->file);
+    }
+  }
+
+  free(path);
+
+  return ok;
+}
+
+void close_library(rom_library *lib) {
+  unmap_file(&lib->file);
+  lib->entries = NULL;
+  lib->count = 0;
+}
+
+const lib_entry *find_rom(const rom_library *lib, const uint8_t *image, size_t size) {
+  uint64_t hash = hash_rom(image, size);
+  uint32_t lo = 0, hi = lib->count;
+
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if(lib->entries[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for(; lo < lib->count && lib->entries[lo].hash == hash; lo++)
+    if(lib->entries[lo].size == size)
+      return &lib->entries[lo];
+
+  return NULL;
+}
+
+static int by_name(const void *a, const void *b) {
+  return strcmp(((const lib_entry *)a)->name, ((const lib_entry *)b)->name);
+}
+
+static int by_hash(const void *a, const void *b) {
+  const lib_entry *x = a, *y = b;
+
+  if(x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
+
+static bool write_index(const char *dir, const lib_entry *entries, uint32_t count) {
+  char *path = index_path(dir), *tmp = malloc(strlen(path) + 5);
+  lib_header h;
+  bool ok = false;
+  FILE *fp;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, LIB_MAGIC, sizeof(h.magic));
+  h.version = LIB_VERSION;
+  h.entry_size = sizeof(lib_entry);
+  h.count = count;
+
+  strcpy(tmp, path);
+  strcat(tmp, ".tmp");
+
+  /* Write aside and rename, as save states */
+  if((fp = fopen(tmp, "wb")) != NULL) {
+    ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    ok = ok && fwrite(entries, sizeof(lib_entry), count, fp) == count;
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if(!ok)
+      remove(tmp);
+  }
+
+  if(!ok)
+    fprintf(stderr, "%s: could not write library index\n", path);
+
+  free(tmp);
+  free(path);
+
+  return ok;
+}
+
+bool scan_library(const char *dir) {
+  rom_library old;
+  lib_entry *by_names = NULL, *entries = NULL;
+  uint32_t count = 0, cap = 0, analysed = 0;
+  struct dirent *de;
+  DIR *d;
+  bool ok;
+
+  if((d = opendir(dir)) == NULL) {
+    perror(dir);
+    return false;
+  }
+
+  /* Entries of the previous index, sorted by name to find unchanged files */
+  if(open_library(dir, &old) && old.count > 0) {
+    by_names = malloc(old.count * sizeof(lib_entry));
+    memcpy(by_names, old.entries, old.count * sizeof(lib_entry));
+    qsort(by_names, old.count, sizeof(lib_entry), by_name);
+  }
+
+  while((de = readdir(d)) != NULL) {
+    size_t len = strlen(de->d_name);
+    char *path = malloc(strlen(dir) + len + 2);
+    const lib_entry *prev = NULL;
+    struct stat sb;
+    lib_entry key;
+
+    sprintf(path, "%s/%s", dir, de->d_name);
+
+    /* Hidden files, the index among them, aren't ROMs */
+    if(de->d_name[0] == '.' || len >= LIB_NAME_SIZE || stat(path, &sb) != 0
+       || !S_ISREG(sb.st_mode) || sb.st_size == 0 || sb.st_size > FREE_MEM) {
+      free(path);
+      continue;
+    }
+
+    if(count == cap) {
+      cap = cap ? cap * 2 : 64;
+      entries = realloc(entries, cap * sizeof(lib_entry));
+    }
+
+    strcpy(key.name, de->d_name);
+    if(by_names != NULL)
+      prev = bsearch(&key, by_names, old.count, sizeof(lib_entry), by_name);
+
+    if(prev != NULL && prev->size == (uint32_t)sb.st_size && prev->mtime == (int64_t)sb.st_mtime)
+      entries[count++] = *prev;
+    else {
+      mapped_file rom;
+
+      if(!map_file(path, &rom)) {
+        free(path);
+        continue;
+      }
+
+      /* Save states have the size of a ROM but aren't one */
+      if(!is_state(rom.data, rom.size)) {
+        lib_entry *e = &entries[count++];
+
+        memset(e, 0, sizeof(*e));
+        analyse_rom(rom.data, rom.size, e);
+        strcpy(e->name, de->d_name);
+        e->mtime = (int64_t)sb.st_mtime;
+        analysed++;
+      }
+      unmap_file(&rom);
+    }
+
+    free(path);
+  }
+  closedir(d);
+
+  qsort(entries, count, sizeof(lib_entry), by_hash);
+  ok = write_index(dir, entries, count);
+
+  printf("%-24s %-16s %5s %-7s %9s %4s\n", "ROM", "Hash", "Size", "Type", "Reachable", "IPF");
+  for(uint32_t i=0; i<count; i++)
+    printf("%-24s %016llX %5u %-7s %9u %4u\n", entries[i].name, (unsigned long long)entries[i].hash,
+           entries[i].size, platform_name(entries[i].platform), entries[i].n_reachable, entries[i].ipf);
+  printf("%u ROMs in %s, %u analysed, %u unchanged\n", count, dir, analysed, count - analysed);
+
+  free(entries);
+  free(by_names);
+  close_library(&old);
+
+  return ok;
+}
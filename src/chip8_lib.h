@@ -0,0 +1,84 @@
+#ifndef _CHIP8_LIB_H_
+#define _CHIP8_LIB_H_
+
+  #include <stdint.h>
+  #include <stdbool.h>
+  #include <stddef.h>
+  #include "chip8.h"
+
+  #define LIB_MAGIC     "CHIP8LIB"
+  #define LIB_VERSION   1
+
+  /* Index file kept in the library directory, skipped by the scan */
+  #define LIB_INDEX     ".chip8lib"
+
+  #define LIB_NAME_SIZE 64
+
+  /* Recommended instructions per frame of SUPER-CHIP ROMs, which expect a faster CPU */
+  #define SCHIP_IPF     30
+
+  enum {
+    PLATFORM_CHIP8 = 0,
+    PLATFORM_SCHIP
+  };
+
+  const char *platform_name(uint8_t platform);
+
+  /* A file mapped read-only, data is NULL when it is empty */
+  typedef struct {
+    const uint8_t *data;
+    size_t size;
+  } mapped_file;
+
+  /* Index file layout, written as is in host byte order: a header and then
+  * fixed-size entries sorted by hash, so the mmap()ed file is searched in place.
+  */
+  typedef struct {
+    char magic[8];                    /* LIB_MAGIC, not NUL terminated */
+    uint32_t version;                 /* LIB_VERSION */
+    uint32_t entry_size;              /* sizeof(lib_entry) */
+    uint32_t count;
+    uint32_t reserved[3];
+  } lib_header;
+
+  typedef struct {
+    uint64_t hash;                    /* FNV-1a of the ROM image */
+    int64_t mtime;                    /* Of the file when it was analysed */
+    uint32_t size;
+    uint32_t n_reachable;             /* Instructions reachable from PRG_ADDR */
+    uint8_t platform;                 /* PLATFORM_CHIP8 or PLATFORM_SCHIP */
+    uint8_t ipf;                      /* Recommended instructions per frame */
+    uint8_t reserved[6];
+    char name[LIB_NAME_SIZE];         /* File name in the library directory */
+    uint8_t reachable[MEM_SIZE / 8];  /* Bit n set when an instruction starts at address n */
+  } lib_entry;
+
+  /* An index mapped by open_library() */
+  typedef struct {
+    mapped_file file;
+    const lib_entry *entries;
+    uint32_t count;
+  } rom_library;
+
+  /* mmap() path read-only, false with a message on stderr if it can't be */
+  bool map_file(const char *path, mapped_file *mf);
+  void unmap_file(mapped_file *mf);
+
+  uint64_t hash_rom(const uint8_t *image, size_t size);
+
+  /* Fill everything but name and mtime from the ROM image */
+  void analyse_rom(const uint8_t *image, size_t size, lib_entry *e);
+
+  /* Bring the index of dir up to date and list it. Files whose name, size and
+  * modification time match an entry of the previous index are not read again.
+  * Returns false if the directory can't be read or the index can't be written.
+  */
+  bool scan_library(const char *dir);
+
+  bool open_library(const char *dir, rom_library *lib);
+  void close_library(rom_library *lib);
+
+  /* The entry of the ROM with this image, NULL if it isn't in the library */
+  const lib_entry *find_rom(const rom_library *lib, const uint8_t *image, size_t size);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8.h"
+#include "chip8_movie.h"
+
+#define LINE_SIZE 256
+
+void init_movie(chip8_movie *movie, uint32_t seed, uint32_t ipf) {
+  memset(movie, 0, sizeof(*movie));
+  movie->seed = seed;
+  movie->ipf = ipf;
+}
+
+void free_movie(chip8_movie *movie) {
+  free(movie->events);
+  movie->events = NULL;
+  movie->n_events = movie->cap = 0;
+}
+
+static void add_event(chip8_movie *movie, uint64_t frame, uint8_t key, bool pressed) {
+  if(movie->n_events == movie->cap) {
+    movie->cap = movie->cap ? movie->cap * 2 : 64;
+    movie->events = realloc(movie->events, movie->cap * sizeof(movie_event));
+  }
+
+  movie->events[movie->n_events].frame = frame;
+  movie->events[movie->n_events].key = key;
+  movie->events[movie->n_events].pressed = pressed;
+  movie->n_events++;
+}
+
+void record_keys(chip8_movie *movie, uint64_t frame, uint16_t keys) {
+  uint16_t changed = keys ^ movie->keys;
+
+  for(int i=0; i<16; i++)
+    if(changed & (1 << i))
+      add_event(movie, frame, i, (keys >> i) & 1);
+
+  movie->keys = keys;
+  if(frame >= movie->frames)
+    movie->frames = frame + 1;
+}
+
+void play_keys(const chip8_movie *movie, size_t *next, uint64_t frame, chip8_t *c8) {
+  while(*next < movie->n_events && movie->events[*next].frame <= frame) {
+    c8->keys[movie->events[*next].key] = movie->events[*next].pressed;
+    (*next)++;
+  }
+}
+
+bool write_movie(const chip8_movie *movie, const char *path) {
+  FILE *fp;
+
+  if((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "%s: could not write movie\n", path);
+    return false;
+  }
+
+  fprintf(fp, "# chip8emu movie\n");
+  fprintf(fp, "seed %u\n", movie->seed);
+  fprintf(fp, "ipf %u\n", movie->ipf);
+  fprintf(fp, "frames %llu\n", (unsigned long long)movie->frames);
+
+  for(size_t i=0; i<movie->n_events; i++)
+    fprintf(fp, "%llu %X %d\n", (unsigned long long)movie->events[i].frame,
+            movie->events[i].key, movie->events[i].pressed);
+
+  return fclose(fp) == 0;
+}
+
+bool read_movie(chip8_movie *movie, const char *path) {
+  char line[LINE_SIZE];
+  unsigned long long frame;
+  unsigned int key, pressed;
+  FILE *fp;
+
+  init_movie(movie, 0, 0);
+
+  if((fp = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "%s: file not found\n", path);
+    return false;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    if(line[0] == '#')
+      continue;
+
+    if(sscanf(line, "seed %u", &movie->seed) == 1 || sscanf(line, "ipf %u", &movie->ipf) == 1)
+      continue;
+    if(sscanf(line, "frames %llu", &frame) == 1)
+      movie->frames = frame;
+    else if(sscanf(line, "%llu %x %u", &frame, &key, &pressed) == 3)
+      add_event(movie, frame, key & 0xF, pressed != 0);
+  }
+
+  fclose(fp);
+
+  if(movie->ipf == 0) {
+    fprintf(stderr, "%s: not a movie\n", path);
+    free_movie(movie);
+    return false;
+  }
+
+  return true;
+}
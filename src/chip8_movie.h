@@ -0,0 +1,45 @@
+#ifndef _CHIP8_MOVIE_H_
+#define _CHIP8_MOVIE_H_
+
+  #include <stdint.h>
+  #include <stdbool.h>
+  #include <stddef.h>
+  #include "chip8.h"
+
+  typedef struct {
+    uint64_t frame;     /* Applied before this frame runs */
+    uint8_t key;
+    bool pressed;
+  } movie_event;
+
+  /* Keypad input of a run, frame by frame, with everything else needed to
+  * repeat it exactly: the CXNN seed and the instructions per frame.
+  *
+  * On disk it is a text file of "seed N", "ipf N" and "frames N" lines,
+  * then one line per key change: frame key state, where key is the hex
+  * keypad index and state is 1 for pressed or 0 for released.
+  * Lines starting with '#' are ignored.
+  */
+  typedef struct {
+    uint32_t seed;
+    uint32_t ipf;
+    uint64_t frames;      /* Length of the recorded run */
+    movie_event *events;
+    size_t n_events;
+    size_t cap;
+    uint16_t keys;        /* Keypad as of the last recorded frame */
+  } chip8_movie;
+
+  void init_movie(chip8_movie *movie, uint32_t seed, uint32_t ipf);
+  void free_movie(chip8_movie *movie);
+
+  /* Log how the keypad mask changed since the previous frame */
+  void record_keys(chip8_movie *movie, uint64_t frame, uint16_t keys);
+
+  /* Set the keys of c8 for frame, *next is the first event not yet applied */
+  void play_keys(const chip8_movie *movie, size_t *next, uint64_t frame, chip8_t *c8);
+
+  bool write_movie(const chip8_movie *movie, const char *path);
+  bool read_movie(chip8_movie *movie, const char *path);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8.h"
+#include "chip8_dbg.h"
+#include "chip8_prof.h"
+
+/* Longest delay timer polling loop recognised, in instructions */
+#define POLL_LOOP_MAX 4
+
+/* Opcode classes are the handlers of the pre-decoded engine, one per case
+* of the emulate_cycle() switch.
+*/
+static const char *class_names[OP_COUNT] = {
+  [OP_CLS] = "00E0", [OP_RET] = "00EE", [OP_JP] = "1NNN", [OP_CALL] = "2NNN",
+  [OP_SE_NN] = "3XNN", [OP_SNE_NN] = "4XNN", [OP_SE_VY] = "5XY0", [OP_LD_NN] = "6XNN",
+  [OP_ADD_NN] = "7XNN", [OP_LD_VY] = "8XY0", [OP_OR] = "8XY1", [OP_AND] = "8XY2",
+  [OP_XOR] = "8XY3", [OP_ADD_VY] = "8XY4", [OP_SUB] = "8XY5", [OP_SHR] = "8XY6",
+  [OP_SUBN] = "8XY7", [OP_SHL] = "8XYE", [OP_SNE_VY] = "9XY0", [OP_LD_I] = "ANNN",
+  [OP_JP_V0] = "BNNN", [OP_RND] = "CXNN", [OP_DRW] = "DXYN", [OP_SKP] = "EX9E",
+  [OP_SKNP] = "EXA1", [OP_LD_VX_DT] = "FX07", [OP_LD_K] = "FX0A", [OP_LD_DT_VX] = "FX15",
+  [OP_LD_ST] = "FX18", [OP_ADD_I] = "FX1E", [OP_LD_F] = "FX29", [OP_LD_B] = "FX33",
+  [OP_LD_I_VX] = "FX55", [OP_LD_VX_I] = "FX65", [OP_SCD] = "00CN", [OP_SCR] = "00FB",
+  [OP_SCL] = "00FC", [OP_EXIT] = "00FD", [OP_LOW] = "00FE", [OP_HIGH] = "00FF",
+  [OP_LD_HF] = "FX30", [OP_LD_R] = "FX75", [OP_LD_VX_R] = "FX85", [OP_BAD] = "????"
+};
+
+/* Written only by the emulation thread, read once it has stopped */
+static struct {
+  uint64_t instructions;
+  uint64_t classes[OP_COUNT];
+  uint64_t pcs[MEM_SIZE];
+  uint64_t sprite_pixels;   /* Set bits of the sprites DXYN drew */
+  uint64_t key_waits;       /* FX0A run without a key, pc left in place */
+  uint64_t timer_polls;     /* Instructions spent in loops waiting for DT */
+} prof;
+
+static chip8_engine profiled_engine;
+
+static uint16_t fetch(const chip8_t *c8, uint16_t addr) {
+  return c8->memory[addr & MEM_MASK] << 8 | c8->memory[(addr + 1) & MEM_MASK];
+}
+
+static uint32_t sprite_pixels(const chip8_t *c8, uint16_t opcode) {
+  /* DXY0 is 16x16, two bytes a row */
+  int bytes = (opcode & 0x000F) != 0 ? opcode & 0x000F : 32;
+  uint32_t n = 0;
+
+  for(int i=0; i<bytes; i++)
+    for(uint8_t row = c8->memory[(c8->cpu.I + i) & MEM_MASK]; row != 0; row &= row - 1)
+      n++;
+
+  return n;
+}
+
+/* Engine handed out by init_profile(): counts as it single steps */
+static int run_profiled(chip8_t *c8, uint32_t max_cycles) {
+  for(uint32_t i=0; i<max_cycles; i++) {
+    uint16_t pc = c8->cpu.pc & MEM_MASK, opcode = fetch(c8, pc);
+    uint32_t before = c8->cpu.cycle_count;
+    chip8_insn in;
+    int status;
+
+    if((opcode & 0xF000) == 0xD000)
+      prof.sprite_pixels += sprite_pixels(c8, opcode);
+
+    status = profiled_engine(c8, 1);
+    if(c8->cpu.cycle_count == before)
+      return status;
+
+    prof.instructions++;
+    decode_opcode(opcode, &in);
+    prof.classes[in.op]++;
+    prof.pcs[pc]++;
+
+    if((opcode & 0xF0FF) == 0xF00A && c8->cpu.pc == pc)
+      prof.key_waits++;
+
+    /* A short backward jump to an FX07 closes one turn of a polling loop */
+    if((opcode & 0xF000) == 0x1000 && (opcode & 0x0FFF) < pc
+       && pc - (opcode & 0x0FFF) < 2 * POLL_LOOP_MAX
+       && (fetch(c8, opcode & 0x0FFF) & 0xF0FF) == 0xF007)
+      prof.timer_polls += (pc - (opcode & 0x0FFF)) / 2 + 1;
+
+    if(status != CHIP8_OK)
+      return status;
+  }
+
+  return CHIP8_OK;
+}
+
+chip8_engine init_profile(chip8_engine engine) {
+  memset(&prof, 0, sizeof(prof));
+  profiled_engine = engine;
+
+  return run_profiled;
+}
+
+static int by_count(const void *a, const void *b) {
+  uint64_t ca = prof.pcs[*(const uint16_t *)a], cb = prof.pcs[*(const uint16_t *)b];
+
+  return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static double percent(uint64_t n) {
+  return prof.instructions ? 100.0 * (double)n / (double)prof.instructions : 0.0;
+}
+
+bool write_profile(const chip8_t *c8, const char *json_file) {
+  uint16_t hot[MEM_SIZE];
+  uint8_t order[OP_COUNT];
+  size_t n_hot = 0;
+  char text[DISASM_SIZE];
+  FILE *fp;
+
+  for(uint16_t pc=0; pc<MEM_SIZE; pc++)
+    if(prof.pcs[pc] != 0)
+      hot[n_hot++] = pc;
+  qsort(hot, n_hot, sizeof(hot[0]), by_count);
+  if(n_hot > PROF_HOT_PCS)
+    n_hot = PROF_HOT_PCS;
+
+  /* Classes busiest first, a handful of them so a plain sort will do */
+  for(int i=0; i<OP_COUNT; i++)
+    order[i] = (uint8_t)i;
+  for(int i=1; i<OP_COUNT; i++)
+    for(int j=i; j>0 && prof.classes[order[j]] > prof.classes[order[j-1]]; j--) {
+      uint8_t t = order[j];
+      order[j] = order[j-1];
+      order[j-1] = t;
+    }
+
+  printf("Profile: %llu instructions\n", (unsigned long long)prof.instructions);
+  for(int i=0; i<OP_COUNT && prof.classes[order[i]] != 0; i++)
+    printf("  %s  %12llu  %5.1f%%\n", class_names[order[i]],
+           (unsigned long long)prof.classes[order[i]], percent(prof.classes[order[i]]));
+
+  printf("Sprites: %llu drawn, %llu pixels set\n",
+         (unsigned long long)prof.classes[OP_DRW], (unsigned long long)prof.sprite_pixels);
+  printf("Waiting: %llu in FX0A (%.1f%%), %llu polling the delay timer (%.1f%%)\n",
+         (unsigned long long)prof.key_waits, percent(prof.key_waits),
+         (unsigned long long)prof.timer_polls, percent(prof.timer_polls));
+
+  printf("Hot addresses:\n");
+  for(size_t i=0; i<n_hot; i++) {
+    disassemble(fetch(c8, hot[i]), text, sizeof(text));
+    printf("  %03X: %04X  %-20s %12llu  %5.1f%%\n", hot[i], fetch(c8, hot[i]), text,
+           (unsigned long long)prof.pcs[hot[i]], percent(prof.pcs[hot[i]]));
+  }
+
+  if((fp = fopen(json_file, "w")) == NULL) {
+    fprintf(stderr, "%s: could not write profile\n", json_file);
+    return false;
+  }
+
+  fprintf(fp, "{\n  \"instructions\": %llu,\n  \"classes\": {", (unsigned long long)prof.instructions);
+  for(int i=0, first=1; i<OP_COUNT; i++)
+    if(prof.classes[order[i]] != 0) {
+      fprintf(fp, "%s\n    \"%s\": %llu", first ? "" : ",", class_names[order[i]],
+              (unsigned long long)prof.classes[order[i]]);
+      first = 0;
+    }
+  fprintf(fp, "\n  },\n  \"sprites\": %llu,\n  \"sprite_pixels\": %llu,\n",
+          (unsigned long long)prof.classes[OP_DRW], (unsigned long long)prof.sprite_pixels);
+  fprintf(fp, "  \"key_waits\": %llu,\n  \"timer_polls\": %llu,\n  \"hot_pcs\": [",
+          (unsigned long long)prof.key_waits, (unsigned long long)prof.timer_polls);
+  for(size_t i=0; i<n_hot; i++) {
+    disassemble(fetch(c8, hot[i]), text, sizeof(text));
+    fprintf(fp, "%s\n    {\"pc\": %u, \"opcode\": \"%04X\", \"mnemonic\": \"%s\", \"count\": %llu}",
+            i ? "," : "", hot[i], fetch(c8, hot[i]), text, (unsigned long long)prof.pcs[hot[i]]);
+  }
+  /* The whole histogram, by address, for tools that want more than the top */
+  fprintf(fp, "\n  ],\n  \"pcs\": [");
+  for(uint16_t pc=0, first=1; pc<MEM_SIZE; pc++) {
+    if(prof.pcs[pc] == 0)
+      continue;
+    disassemble(fetch(c8, pc), text, sizeof(text));
+    fprintf(fp, "%s\n    {\"pc\": %u, \"opcode\": \"%04X\", \"mnemonic\": \"%s\", \"count\": %llu}",
+            first ? "" : ",", pc, fetch(c8, pc), text, (unsigned long long)prof.pcs[pc]);
+    first = 0;
+  }
+  fprintf(fp, "\n  ]\n}\n");
+
+  return fclose(fp) == 0;
+}
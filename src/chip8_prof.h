@@ -0,0 +1,20 @@
+#ifndef _CHIP8_PROF_H_
+#define _CHIP8_PROF_H_
+
+  #include <stdbool.h>
+  #include "chip8.h"
+
+  /* Addresses listed in the report, busiest first */
+  #define PROF_HOT_PCS 16
+
+  /* Start counting. Returns an engine running engine one instruction at a
+  * time and counting each one; emulation with the plain engine costs nothing.
+  */
+  chip8_engine init_profile(chip8_engine engine);
+
+  /* Print the report to stdout and write it as JSON to json_file.
+  * c8 supplies the opcodes shown next to the hot addresses.
+  */
+  bool write_profile(const chip8_t *c8, const char *json_file);
+
+#endif
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+#include "chip8.h"
+#include "chip8_state.h"
+#include "chip8_rewind.h"
+
+/* Bytes of history per frame record slot: the arena gets the rest of the budget */
+#define BYTES_PER_SLOT 128
+
+/* A keyframe is the largest record, a delta that would be larger is stored as one */
+#define MAX_RECORD ((uint32_t)sizeof(chip8_state))
+
+/* Zero bytes that end a literal run, fewer are cheaper to copy than a new token */
+#define MIN_ZERO_RUN 4
+
+static rewind_frame *frame_at(rewind_buffer *rw, uint32_t seq) {
+  return &rw->frames[seq % rw->max_frames];
+}
+
+bool init_rewind(rewind_buffer *rw, size_t max_bytes) {
+  memset(rw, 0, sizeof(*rw));
+
+  rw->max_frames = (uint32_t)(max_bytes / BYTES_PER_SLOT);
+  if(max_bytes > UINT32_MAX || rw->max_frames < 2 * REWIND_KEY_INTERVAL)
+    return false;
+
+  rw->arena_size = (uint32_t)(max_bytes - rw->max_frames * sizeof(rewind_frame));
+  rw->arena = malloc(rw->arena_size);
+  rw->frames = malloc(rw->max_frames * sizeof(rewind_frame));
+
+  if(rw->arena == NULL || rw->frames == NULL) {
+    free_rewind(rw);
+    return false;
+  }
+
+  return true;
+}
+
+void free_rewind(rewind_buffer *rw) {
+  free(rw->arena);
+  free(rw->frames);
+  rw->arena = NULL;
+  rw->frames = NULL;
+}
+
+/* Drop the oldest keyframe and every delta taken against it */
+static void evict_segment(rewind_buffer *rw) {
+  uint32_t key = rw->first;
+
+  do
+    rw->first++;
+  while(rw->first != rw->next && frame_at(rw, rw->first)->key_seq == key);
+
+  if(rw->have_key && rw->key_seq == key)
+    rw->have_key = false;
+}
+
+/* Make room for MAX_RECORD bytes and return where the record goes */
+static uint32_t reserve(rewind_buffer *rw) {
+  uint32_t p = rw->head;
+
+  if(p + MAX_RECORD > rw->arena_size) {
+    /* Everything between head and the end of the arena is older than what is at 0 */
+    while(rw->first != rw->next && frame_at(rw, rw->first)->offset >= p)
+      evict_segment(rw);
+    p = 0;
+  }
+
+  while(rw->first != rw->next && frame_at(rw, rw->first)->offset >= p
+        && frame_at(rw, rw->first)->offset < p + MAX_RECORD)
+    evict_segment(rw);
+
+  while(rw->next - rw->first >= rw->max_frames)
+    evict_segment(rw);
+
+  return p;
+}
+
+/* Encode cur XOR key as tokens of (zero bytes, literal bytes) counts, 16 bits
+* each, followed by the literals. Returns false if it would exceed limit bytes.
+*/
+static bool encode_delta(const uint8_t *cur, const uint8_t *key, size_t n, uint8_t *out, uint32_t limit, uint32_t *out_size) {
+  uint32_t size = 0;
+  size_t i = 0;
+
+  while(i < n) {
+    size_t zeros = 0, lits = 0;
+    uint16_t counts[2];
+
+    /* Skip unchanged bytes, eight at a time while they are aligned */
+    while(i + zeros < n && zeros < UINT16_MAX && cur[i + zeros] == key[i + zeros]) {
+      zeros++;
+      if(((i + zeros) & 7) == 0) {
+        while(i + zeros + 8 <= n && zeros + 8 <= UINT16_MAX
+              && memcmp(cur + i + zeros, key + i + zeros, 8) == 0)
+          zeros += 8;
+      }
+    }
+    i += zeros;
+
+    /* Changed bytes, up to a run of zeros worth a new token */
+    while(i + lits < n && lits < UINT16_MAX) {
+      size_t run = 0;
+
+      while(run < MIN_ZERO_RUN && i + lits + run < n && cur[i + lits + run] == key[i + lits + run])
+        run++;
+      if(run == MIN_ZERO_RUN || i + lits + run == n)
+        break;
+      lits += run + 1;
+    }
+
+    if(zeros == 0 && lits == 0)
+      break;
+    if(size + sizeof(counts) + lits > limit)
+      return false;
+
+    counts[0] = (uint16_t)zeros;
+    counts[1] = (uint16_t)lits;
+    memcpy(out + size, counts, sizeof(counts));
+    size += sizeof(counts);
+    for(size_t j=0; j<lits; j++)
+      out[size + j] = cur[i + j] ^ key[i + j];
+    size += (uint32_t)lits;
+    i += lits;
+  }
+
+  *out_size = size;
+  return true;
+}
+
+static void apply_delta(uint8_t *state, const uint8_t *delta, uint32_t size) {
+  uint32_t pos = 0;
+  size_t i = 0;
+
+  while(pos < size) {
+    uint16_t counts[2];
+
+    memcpy(counts, delta + pos, sizeof(counts));
+    pos += sizeof(counts);
+    i += counts[0];
+    for(size_t j=0; j<counts[1]; j++)
+      state[i + j] ^= delta[pos + j];
+    pos += counts[1];
+    i += counts[1];
+  }
+}
+
+void rewind_capture(rewind_buffer *rw, const chip8_t *c8) {
+  uint32_t p = reserve(rw);
+  rewind_frame *f = frame_at(rw, rw->next);
+  uint32_t size;
+
+  save_state(c8, &rw->scratch);
+
+  if(!rw->have_key || rw->next - rw->key_seq >= REWIND_KEY_INTERVAL
+     || !encode_delta((const uint8_t *)&rw->scratch, (const uint8_t *)&rw->key,
+                      sizeof(chip8_state), rw->arena + p, MAX_RECORD - 1, &size)) {
+    memcpy(rw->arena + p, &rw->scratch, sizeof(chip8_state));
+    memcpy(&rw->key, &rw->scratch, sizeof(chip8_state));
+    rw->key_seq = rw->next;
+    rw->have_key = true;
+    size = MAX_RECORD;
+  }
+
+  f->offset = p;
+  f->size = size;
+  f->key_seq = rw->key_seq;
+  rw->head = p + size;
+  rw->next++;
+}
+
+bool rewind_step(rewind_buffer *rw, chip8_t *c8) {
+  rewind_frame *f;
+
+  if(rw->first == rw->next)
+    return false;
+
+  f = frame_at(rw, rw->next - 1);
+  memcpy(&rw->scratch, rw->arena + frame_at(rw, f->key_seq)->offset, sizeof(chip8_state));
+  if(f->key_seq != rw->next - 1)
+    apply_delta((uint8_t *)&rw->scratch, rw->arena + f->offset, f->size);
+  load_state(c8, &rw->scratch);
+
+  /* Recording goes on from here once rewinding stops */
+  rw->next--;
+  rw->head = f->offset;
+  if(rw->first == rw->next)
+    rw->have_key = false;
+  else if(!rw->have_key || rw->key_seq != frame_at(rw, rw->next - 1)->key_seq) {
+    rw->key_seq = frame_at(rw, rw->next - 1)->key_seq;
+    memcpy(&rw->key, rw->arena + frame_at(rw, rw->key_seq)->offset, sizeof(chip8_state));
+    rw->have_key = true;
+  }
+
+  return true;
+}
@@ -0,0 +1,48 @@
+#ifndef _CHIP8_REWIND_H_
+#define _CHIP8_REWIND_H_
+
+  #include <stdint.h>
+  #include <stdbool.h>
+  #include <stddef.h>
+  #include "chip8.h"
+  #include "chip8_state.h"
+
+  /* Frames between two keyframes */
+  #define REWIND_KEY_INTERVAL 60
+
+  typedef struct {
+    uint32_t offset;      /* Where the record starts in the arena */
+    uint32_t size;
+    uint32_t key_seq;     /* Keyframe this frame is a delta of, its own number for keyframes */
+  } rewind_frame;
+
+  /* History of machine states, one per frame, in a fixed amount of memory.
+  * Keyframes are full save states, other frames are the run-length encoded
+  * XOR of their state with the last keyframe. Records go one after the other
+  * in the arena, and the oldest keyframe with its deltas is dropped to make room.
+  */
+  typedef struct {
+    uint8_t *arena;
+    uint32_t arena_size;
+    rewind_frame *frames;     /* Indexed by frame number modulo max_frames */
+    uint32_t max_frames;
+    uint32_t first;           /* Number of the oldest frame kept */
+    uint32_t next;            /* Number the next captured frame gets */
+    uint32_t head;            /* Arena offset of the next record */
+    uint32_t key_seq;         /* Keyframe new deltas are taken against */
+    bool have_key;
+    chip8_state key;          /* That keyframe */
+    chip8_state scratch;
+  } rewind_buffer;
+
+  /* Set up a history using at most max_bytes, false if it can't be allocated */
+  bool init_rewind(rewind_buffer *rw, size_t max_bytes);
+  void free_rewind(rewind_buffer *rw);
+
+  /* Record the machine as it is at the end of a frame, without allocating */
+  void rewind_capture(rewind_buffer *rw, const chip8_t *c8);
+
+  /* Restore the newest recorded frame and forget it, false when none is left */
+  bool rewind_step(rewind_buffer *rw, chip8_t *c8);
+
+#endif
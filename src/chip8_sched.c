@@ -0,0 +1,198 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "chip8.h"
+#include "chip8_sched.h"
+
+#define NSEC_PER_SEC  1000000000L
+#define FRAME_NSEC    (NSEC_PER_SEC / FRAME_RATE)
+
+static bool idle_skip = true;
+
+/* Follow one turn of the loop at pc on the registers V, leaving the machine
+* alone. *last gets the instruction that closes the turn. Returns the length
+* of the turn, 0 if an instruction with other inputs or outputs comes first.
+*/
+static uint32_t idle_turn(const chip8_t *c8, uint8_t V[16], uint16_t *last) {
+  uint16_t start = c8->cpu.pc, pc = start;
+
+  for(uint32_t n=1; n<=IDLE_LOOP_MAX; n++) {
+    uint16_t opcode;
+    uint8_t x, y;
+
+    if(pc > MEM_SIZE - 2)
+      return 0;
+
+    opcode = c8->memory[pc] << 8 | c8->memory[pc + 1];
+    x = (opcode & 0x0F00) >> 8;
+    y = (opcode & 0x00F0) >> 4;
+
+    switch(opcode & 0xF000) {
+      case 0x1000:
+        pc = opcode & 0x0FFF;
+        break;
+      case 0x3000:
+        pc += V[x] == (opcode & 0x00FF) ? 4 : 2;
+        break;
+      case 0x4000:
+        pc += V[x] != (opcode & 0x00FF) ? 4 : 2;
+        break;
+      case 0x5000:
+        if((opcode & 0x000F) != 0)
+          return 0;
+        pc += V[x] == V[y] ? 4 : 2;
+        break;
+      case 0x6000:
+        V[x] = opcode & 0x00FF;
+        pc += 2;
+        break;
+      case 0x9000:
+        if((opcode & 0x000F) != 0)
+          return 0;
+        pc += V[x] != V[y] ? 4 : 2;
+        break;
+      case 0xE000:
+        if(V[x] > 0xF || ((opcode & 0x00FF) != 0x9E && (opcode & 0x00FF) != 0xA1))
+          return 0;
+        pc += c8->keys[V[x]] == ((opcode & 0x00FF) == 0x9E) ? 4 : 2;
+        break;
+      case 0xF000:
+        if((opcode & 0x00FF) == 0x07) {
+          V[x] = c8->cpu.delay_timer;
+          pc += 2;
+          break;
+        }
+        /* FX0A stays put until a key is down */
+        if((opcode & 0x00FF) == 0x0A) {
+          for(int i=0; i<16; i++)
+            if(c8->keys[i])
+              return 0;
+          break;
+        }
+        return 0;
+      default:
+        return 0;
+    }
+
+    *last = opcode;
+    if(pc == start)
+      return n;
+  }
+
+  return 0;
+}
+
+uint32_t skip_idle(chip8_t *c8, uint32_t max_cycles) {
+  uint8_t once[16], twice[16];
+  uint16_t last;
+  uint32_t n, skipped;
+
+  if(!idle_skip)
+    return 0;
+
+  memcpy(once, c8->cpu.V, sizeof(once));
+  if((n = idle_turn(c8, once, &last)) == 0 || n > max_cycles)
+    return 0;
+
+  /* The registers after one turn must be left alone by the next, then every
+  * turn after the first is the same and skipping any number of them is exact
+  */
+  memcpy(twice, once, sizeof(twice));
+  if(idle_turn(c8, twice, &last) != n || memcmp(once, twice, sizeof(once)) != 0)
+    return 0;
+
+  skipped = max_cycles - max_cycles % n;
+  memcpy(c8->cpu.V, once, sizeof(once));
+  c8->cpu.opcode = last;
+  c8->cpu.cycle_count += skipped;
+
+  return skipped;
+}
+
+void enable_idle_skip(bool on) {
+  idle_skip = on;
+}
+
+int run_frame(chip8_t *c8, chip8_engine engine, uint32_t ipf) {
+  uint32_t skipped = skip_idle(c8, ipf);
+  int status = skipped < ipf ? engine(c8, ipf - skipped) : CHIP8_OK;
+
+  if(status == CHIP8_OK)
+    tick_timers(c8);
+
+  return status;
+}
+
+void init_frame_clock(frame_clock *fc) {
+  clock_gettime(CLOCK_MONOTONIC, &fc->deadline);
+}
+
+uint64_t resume_frame_clock(frame_clock *fc) {
+  struct timespec now;
+  int64_t late;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  late = (int64_t)(now.tv_sec - fc->deadline.tv_sec) * NSEC_PER_SEC + (now.tv_nsec - fc->deadline.tv_nsec);
+  fc->deadline = now;
+
+  return late > 0 ? (uint64_t)late / FRAME_NSEC : 0;
+}
+
+void wait_frame(frame_clock *fc) {
+  struct timespec now;
+
+  fc->deadline.tv_nsec += FRAME_NSEC;
+  if(fc->deadline.tv_nsec >= NSEC_PER_SEC) {
+    fc->deadline.tv_nsec -= NSEC_PER_SEC;
+    fc->deadline.tv_sec++;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if(now.tv_sec > fc->deadline.tv_sec + 1
+     || (now.tv_sec - fc->deadline.tv_sec) * NSEC_PER_SEC + (now.tv_nsec - fc->deadline.tv_nsec) > FRAME_NSEC) {
+    fc->deadline = now;
+    return;
+  }
+
+  /* Restart after signals, the deadline stays the same */
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &fc->deadline, NULL) == EINTR)
+    ;
+}
+
+bool frame_due(frame_clock *fc) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if((now.tv_sec - fc->deadline.tv_sec) * NSEC_PER_SEC + (now.tv_nsec - fc->deadline.tv_nsec) < FRAME_NSEC)
+    return false;
+
+  fc->deadline = now;
+  return true;
+}
+
+void init_speed_meter(speed_meter *m) {
+  clock_gettime(CLOCK_MONOTONIC, &m->start);
+  m->frames = 0;
+}
+
+uint32_t count_frame(speed_meter *m) {
+  struct timespec now;
+  int64_t elapsed;
+  uint32_t percent;
+
+  /* Reading the clock every frame would cost more than a frame of most ROMs */
+  if(++m->frames % FRAME_RATE != 0)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (int64_t)(now.tv_sec - m->start.tv_sec) * NSEC_PER_SEC + (now.tv_nsec - m->start.tv_nsec);
+  if(elapsed < NSEC_PER_SEC)
+    return 0;
+
+  percent = (uint32_t)(m->frames * FRAME_NSEC * 100 / (uint64_t)elapsed);
+  m->start = now;
+  m->frames = 0;
+
+  return percent > 0 ? percent : 1;
+}
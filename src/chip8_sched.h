@@ -0,0 +1,74 @@
+#ifndef _CHIP8_SCHED_H_
+#define _CHIP8_SCHED_H_
+
+  #include <stdint.h>
+  #include <stdbool.h>
+  #include <time.h>
+  #include "chip8.h"
+
+  /* Timers count down and the screen is presented at 60 Hz */
+  #define FRAME_RATE 60
+
+  /* Instructions per frame unless --ipf says otherwise, a 600 Hz CPU */
+  #define DEFAULT_IPF 10
+
+  /* Absolute deadline of the next frame, so sleeping never drifts */
+  typedef struct {
+    struct timespec deadline;
+  } frame_clock;
+
+  /* Emulated frames against host time, to show how fast turbo runs */
+  typedef struct {
+    struct timespec start;
+    uint64_t frames;
+  } speed_meter;
+
+  /* Longest idle loop skip_idle() recognises, in instructions */
+  #define IDLE_LOOP_MAX 8
+
+  /* Run one frame of ipf instructions on engine, then tick the timers.
+  * Returns the engine status, timers are left alone when it isn't CHIP8_OK.
+  */
+  int run_frame(chip8_t *c8, chip8_engine engine, uint32_t ipf);
+
+  /* If pc is in a loop that only reads registers, the delay timer or keys and
+  * only writes registers, such as FX07 / 3X00 / 1NNN waiting for the delay
+  * timer or FX0A waiting for a key, account for as many whole turns of it as
+  * fit in max_cycles without running them. The machine ends up exactly as if
+  * they had been run. Returns the instructions skipped, a multiple of the loop
+  * length, 0 when there is no such loop or skipping is off.
+  */
+  uint32_t skip_idle(chip8_t *c8, uint32_t max_cycles);
+
+  /* On by default. Off for engines that must see every instruction, such as
+  * the tracer, profiler and debugger.
+  */
+  void enable_idle_skip(bool on);
+
+  /* Start pacing frames from now */
+  void init_frame_clock(frame_clock *fc);
+
+  /* For a thread that slept outside wait_frame(): returns how many whole
+  * frames went by since the last deadline and paces from now on.
+  */
+  uint64_t resume_frame_clock(frame_clock *fc);
+
+  /* Sleep until the next frame is due. A host that fell more than a frame
+  * behind starts again from now instead of running frames back to back.
+  */
+  void wait_frame(frame_clock *fc);
+
+  /* For frames run back to back: true once a frame period went by since the
+  * last time it was, so a screen is shown at most FRAME_RATE times a second.
+  */
+  bool frame_due(frame_clock *fc);
+
+  void init_speed_meter(speed_meter *m);
+
+  /* Count one emulated frame. Once a second of host time has gone by, returns
+  * the speed since the last report in percent of real time and starts over,
+  * before that returns 0.
+  */
+  uint32_t count_frame(speed_meter *m);
+
+#endif
@@ -0,0 +1,139 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chip8.h"
+#include "chip8_state.h"
+
+#define BYTE_ORDER_MARK 0x01020304
+
+_Static_assert(sizeof(chip8_state) % 8 == 0 && offsetof(chip8_state, gfx) == 64,
+               "chip8_state must have no padding and a 64-byte header");
+
+void save_state(const chip8_t *c8, chip8_state *st) {
+  memset(st, 0, sizeof(*st));
+  memcpy(st->magic, STATE_MAGIC, sizeof(st->magic));
+  st->version = STATE_VERSION;
+  st->byte_order = BYTE_ORDER_MARK;
+  st->size = sizeof(*st);
+
+  memcpy(st->gfx, c8->gfx, sizeof(st->gfx));
+  st->cycle_count = c8->cpu.cycle_count;
+  st->rng = c8->cpu.rng;
+  memcpy(st->stack, c8->cpu.stack, sizeof(st->stack));
+  st->I = c8->cpu.I;
+  st->pc = c8->cpu.pc;
+  st->opcode = c8->cpu.opcode;
+  memcpy(st->V, c8->cpu.V, sizeof(st->V));
+  for(int i=0; i<16; i++)
+    st->keys[i] = c8->keys[i];
+  memcpy(st->flags, c8->flags, sizeof(st->flags));
+  st->sp = c8->cpu.sp;
+  st->delay_timer = c8->cpu.delay_timer;
+  st->sound_timer = c8->cpu.sound_timer;
+  st->hires = c8->cpu.hires;
+  memcpy(st->memory, c8->memory, sizeof(st->memory));
+}
+
+bool is_state(const void *data, size_t size) {
+  const chip8_state *st = data;
+
+  return size == sizeof(chip8_state) && memcmp(st->magic, STATE_MAGIC, sizeof(st->magic)) == 0;
+}
+
+bool load_state(chip8_t *c8, const chip8_state *st) {
+  if(!is_state(st, st->size) || st->version != STATE_VERSION || st->byte_order != BYTE_ORDER_MARK)
+    return false;
+
+  /* sp is 16 with a full stack, anything above can't have been saved */
+  if(st->sp > sizeof(c8->cpu.stack) / sizeof(c8->cpu.stack[0]))
+    return false;
+
+  memcpy(c8->gfx, st->gfx, sizeof(c8->gfx));
+  c8->cpu.cycle_count = st->cycle_count;
+  c8->cpu.rng = st->rng ? st->rng : 1;
+  memcpy(c8->cpu.stack, st->stack, sizeof(c8->cpu.stack));
+  c8->cpu.I = st->I;
+  c8->cpu.pc = st->pc;
+  c8->cpu.opcode = st->opcode;
+  memcpy(c8->cpu.V, st->V, sizeof(c8->cpu.V));
+  for(int i=0; i<16; i++)
+    c8->keys[i] = st->keys[i] != 0;
+  memcpy(c8->flags, st->flags, sizeof(c8->flags));
+  c8->cpu.sp = st->sp;
+  c8->cpu.delay_timer = st->delay_timer;
+  c8->cpu.sound_timer = st->sound_timer;
+  c8->cpu.hires = st->hires != 0;
+  memcpy(c8->memory, st->memory, sizeof(c8->memory));
+
+  invalidate_decoded(c8, 0, MEM_SIZE);
+  c8->dirty_rows = ~(uint64_t)0;
+  c8->cpu.draw_flag = true;
+
+  return true;
+}
+
+bool write_state_file(const chip8_t *c8, const char *path) {
+  chip8_state *st = malloc(sizeof(chip8_state));
+  size_t len = strlen(path);
+  char *tmp = malloc(len + 5);
+  bool ok = false;
+  FILE *fp;
+
+  save_state(c8, st);
+  memcpy(tmp, path, len);
+  memcpy(tmp + len, ".tmp", 5);
+
+  /* Write aside and rename, so a crash never leaves a half-written state behind */
+  if((fp = fopen(tmp, "wb")) != NULL) {
+    ok = fwrite(st, sizeof(*st), 1, fp) == 1;
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if(!ok)
+      remove(tmp);
+  }
+
+  if(!ok)
+    fprintf(stderr, "%s: could not write save state\n", path);
+
+  free(tmp);
+  free(st);
+
+  return ok;
+}
+
+bool read_state_file(chip8_t *c8, const char *path) {
+  struct stat sb;
+  void *map;
+  bool ok;
+  int fd;
+
+  if((fd = open(path, O_RDONLY)) < 0) {
+    perror(path);
+    return false;
+  }
+
+  if(fstat(fd, &sb) != 0 || (size_t)sb.st_size != sizeof(chip8_state)) {
+    close(fd);
+    fprintf(stderr, "%s: not a save state\n", path);
+    return false;
+  }
+
+  map = mmap(NULL, sizeof(chip8_state), PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+
+  if(!(ok = load_state(c8, map)))
+    fprintf(stderr, "%s: not a save state of this version\n", path);
+
+  munmap(map, sizeof(chip8_state));
+
+  return ok;
+}
@@ -0,0 +1,57 @@
+#ifndef _CHIP8_STATE_H_
+#define _CHIP8_STATE_H_
+
+  #include <stdint.h>
+  #include <stdbool.h>
+  #include "chip8.h"
+
+  #define STATE_MAGIC   "CHIP8SAV"
+  #define STATE_VERSION 2
+
+  /* Save state file layout, written as is in host byte order.
+  * Fields are ordered by size so there is no padding, and the 64-byte header
+  * keeps the machine aligned when the file is mmap()ed. Decode caches and
+  * translated code aren't saved, they are rebuilt after a restore.
+  */
+  typedef struct {
+    /* Header */
+    char magic[8];                    /* STATE_MAGIC, not NUL terminated */
+    uint32_t version;                 /* STATE_VERSION */
+    uint32_t byte_order;              /* 0x01020304 as stored by the writer */
+    uint32_t size;                    /* sizeof(chip8_state) */
+    uint32_t reserved[11];
+
+    /* Machine */
+    uint64_t gfx[HIRES_HEIGHT][ROW_WORDS];
+    uint32_t cycle_count;
+    uint32_t rng;
+    uint16_t stack[16];
+    uint16_t I;
+    uint16_t pc;
+    uint16_t opcode;
+    uint8_t V[16];
+    uint8_t keys[16];
+    uint8_t flags[16];
+    uint8_t sp;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t hires;
+    uint8_t padding[6];
+    uint8_t memory[MEM_SIZE];
+  } chip8_state;
+
+  void save_state(const chip8_t *c8, chip8_state *st);
+
+  /* Restore a saved machine, false if st isn't a save state this build can read */
+  bool load_state(chip8_t *c8, const chip8_state *st);
+
+  /* True when the first size bytes of data look like a save state */
+  bool is_state(const void *data, size_t size);
+
+  /* Write the machine to path, replacing it only once the new file is complete */
+  bool write_state_file(const chip8_t *c8, const char *path);
+
+  /* mmap() path and restore it, false with a message on stderr if it can't be */
+  bool read_state_file(chip8_t *c8, const char *path);
+
+#endif
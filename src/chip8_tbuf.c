@@ -0,0 +1,37 @@
+#include <string.h>
+#include "chip8_tbuf.h"
+
+#define FRAME_FRESH 0x80
+#define SLOT_MASK   0x03
+
+void init_frame_buffer(frame_buffer *fb) {
+  memset(fb->slots, 0, sizeof(fb->slots));
+  fb->back = 0;
+  atomic_init(&fb->shared, 1);
+  fb->front = 2;
+  fb->next_seq = 1;
+}
+
+chip8_frame *frame_back(frame_buffer *fb) {
+  return &fb->slots[fb->back];
+}
+
+void publish_frame(frame_buffer *fb) {
+  fb->slots[fb->back].seq = fb->next_seq++;
+
+  /* Release makes the frame contents visible before the slot index */
+  fb->back = atomic_exchange_explicit(&fb->shared, fb->back | FRAME_FRESH, memory_order_acq_rel) & SLOT_MASK;
+}
+
+bool consume_frame(frame_buffer *fb) {
+  if((atomic_load_explicit(&fb->shared, memory_order_relaxed) & FRAME_FRESH) == 0)
+    return false;
+
+  fb->front = atomic_exchange_explicit(&fb->shared, fb->front, memory_order_acq_rel) & SLOT_MASK;
+
+  return true;
+}
+
+const chip8_frame *frame_front(const frame_buffer *fb) {
+  return &fb->slots[fb->front];
+}
@@ -0,0 +1,40 @@
+#ifndef _CHIP8_TBUF_H_
+#define _CHIP8_TBUF_H_
+
+  #include <stdint.h>
+  #include <stdbool.h>
+  #include <stdatomic.h>
+  #include "chip8.h"
+
+  /* A finished frame, as handed from the emulation thread to the display */
+  typedef struct {
+    uint64_t gfx[HIRES_HEIGHT][ROW_WORDS];
+    uint64_t dirty_rows;    /* Rows drawn since the previous published frame */
+    bool hires;             /* 128x64 rather than 64x32 */
+    uint32_t seq;           /* Publication number, a gap means frames were dropped */
+  } chip8_frame;
+
+  /* Lock-free triple buffer with one producer and one consumer.
+  * The producer fills the back slot and swaps it with the shared one, the
+  * consumer swaps the shared slot with its front one when it holds a fresher
+  * frame. Neither side ever waits, and the consumer always gets the newest frame.
+  */
+  typedef struct {
+    chip8_frame slots[3];
+    _Atomic uint8_t shared;   /* Slot in the middle, with FRAME_FRESH until consumed */
+    uint8_t back;             /* Owned by the producer */
+    uint8_t front;            /* Owned by the consumer */
+    uint32_t next_seq;        /* Owned by the producer */
+  } frame_buffer;
+
+  void init_frame_buffer(frame_buffer *fb);
+
+  /* Producer side: fill frame_back(), then publish it */
+  chip8_frame *frame_back(frame_buffer *fb);
+  void publish_frame(frame_buffer *fb);
+
+  /* Consumer side: true when frame_front() changed to a newer frame */
+  bool consume_frame(frame_buffer *fb);
+  const chip8_frame *frame_front(const frame_buffer *fb);
+
+#endif
@@ -0,0 +1,266 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chip8.h"
+#include "chip8_dbg.h"
+#include "chip8_trace.h"
+
+/* Records in flight between the emulation and writer threads, a power of 2 */
+#define TRACE_RING (1 << 16)
+
+/* Records the emulation thread fills before handing them over */
+#define TRACE_BATCH 256
+
+/* How long the writer thread sleeps when there is nothing to write */
+#define TRACE_IDLE_NS 1000000L
+
+#define TRACE_MAGIC "CHIP8TRC"
+#define TRACE_VERSION 1
+
+/* At the start of a trace file, followed by the records in host byte order */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+} trace_header;
+
+/* Single producer, single consumer. Unlike the debugger ring no record may
+* be dropped, so the emulation thread waits for room when it is full.
+* Each index has its own cache line, and the emulation thread publishes
+* records in batches, so the two threads rarely touch the same line.
+*/
+static struct {
+  trace_record slots[TRACE_RING];
+  _Alignas(64) _Atomic uint32_t head;   /* Next record to write out, moved by the writer thread */
+  _Alignas(64) _Atomic uint32_t tail;   /* End of the published records, moved by the emulation thread */
+} ring;
+
+/* Emulation thread side */
+static uint32_t next_tail;      /* End of the records filled so far */
+static uint32_t cached_head;    /* Last head seen */
+
+static chip8_engine traced_engine;
+static trace_filter filter;
+static FILE *trace_fp;
+static pthread_t writer_tid;
+static atomic_bool writer_quit;
+static bool tracing = false;
+
+void init_trace_filter(trace_filter *f) {
+  f->first_cycle = 0;
+  f->last_cycle = UINT32_MAX;
+  f->first_pc = 0;
+  f->last_pc = MEM_SIZE - 1;
+}
+
+static void publish(void) {
+  atomic_store_explicit(&ring.tail, next_tail, memory_order_release);
+}
+
+static trace_record *next_slot(void) {
+  while(next_tail - cached_head == TRACE_RING) {
+    publish();
+    cached_head = atomic_load_explicit(&ring.head, memory_order_acquire);
+    if(next_tail - cached_head == TRACE_RING)
+      sched_yield();
+  }
+
+  return &ring.slots[next_tail % TRACE_RING];
+}
+
+static void push_slot(void) {
+  if(++next_tail % TRACE_BATCH == 0)
+    publish();
+}
+
+/* Engine handed out by init_trace(): single steps where records are wanted,
+* whole chunks elsewhere.
+*/
+static int run_tracing(chip8_t *c8, uint32_t max_cycles) {
+  uint32_t done = 0;
+
+  while(done < max_cycles) {
+    uint32_t cycle = c8->cpu.cycle_count;
+    uint16_t pc = c8->cpu.pc;
+    uint8_t before[16];
+    trace_record *r;
+    int status;
+
+    /* Outside the cycle range nothing is recorded, so run up to it in one go */
+    if(cycle < filter.first_cycle || cycle > filter.last_cycle) {
+      uint32_t n = max_cycles - done;
+
+      if(cycle < filter.first_cycle && filter.first_cycle - cycle < n)
+        n = filter.first_cycle - cycle;
+      status = traced_engine(c8, n);
+      done += c8->cpu.cycle_count - cycle;
+      if(status != CHIP8_OK || c8->cpu.cycle_count == cycle)
+        return status;
+      continue;
+    }
+
+    memcpy(before, c8->cpu.V, sizeof(before));
+    status = traced_engine(c8, 1);
+    done += c8->cpu.cycle_count - cycle;
+
+    if(pc >= filter.first_pc && pc <= filter.last_pc) {
+      r = next_slot();
+      r->cycle = cycle;
+      r->pc = pc;
+      r->opcode = c8->cpu.opcode;
+      r->I = c8->cpu.I;
+      r->changed = 0;
+      for(int i=0; i<16; i++)
+        r->changed |= (uint16_t)((c8->cpu.V[i] != before[i]) << i);
+      memcpy(r->V, c8->cpu.V, sizeof(r->V));
+      r->sp = c8->cpu.sp;
+      r->delay_timer = c8->cpu.delay_timer;
+      r->sound_timer = c8->cpu.sound_timer;
+      r->status = (uint8_t)status;
+      push_slot();
+    }
+
+    if(status != CHIP8_OK || c8->cpu.cycle_count == cycle)
+      return status;
+  }
+
+  return CHIP8_OK;
+}
+
+/* Write out the records queued so far, at most up to the end of the ring at once */
+static bool drain(void) {
+  uint32_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+  uint32_t n = tail - head;
+
+  if(n == 0)
+    return false;
+
+  if(head % TRACE_RING + n > TRACE_RING)
+    n = TRACE_RING - head % TRACE_RING;
+
+  fwrite(&ring.slots[head % TRACE_RING], sizeof(trace_record), n, trace_fp);
+  atomic_store_explicit(&ring.head, head + n, memory_order_release);
+
+  return true;
+}
+
+/* Writer thread: moves records from the ring to the file until told to stop */
+static void *writer_main(void *arg) {
+  struct timespec idle = {0, TRACE_IDLE_NS};
+
+  (void)arg;
+
+  while(!atomic_load(&writer_quit))
+    if(!drain())
+      nanosleep(&idle, NULL);
+
+  while(drain())
+    ;
+
+  return NULL;
+}
+
+chip8_engine init_trace(chip8_engine engine, const char *path, const trace_filter *f) {
+  trace_header header;
+
+  if((trace_fp = fopen(path, "wb")) == NULL) {
+    fprintf(stderr, "%s: could not create trace\n", path);
+    return NULL;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(trace_record);
+  fwrite(&header, sizeof(header), 1, trace_fp);
+
+  traced_engine = engine;
+  filter = *f;
+  atomic_store(&ring.head, 0);
+  atomic_store(&ring.tail, 0);
+  next_tail = cached_head = 0;
+  atomic_store(&writer_quit, false);
+
+  if(pthread_create(&writer_tid, NULL, writer_main, NULL) != 0) {
+    fclose(trace_fp);
+    return NULL;
+  }
+  tracing = true;
+
+  return run_tracing;
+}
+
+void free_trace(void) {
+  if(!tracing)
+    return;
+
+  /* The emulation thread has stopped, the last partial batch goes too */
+  publish();
+  atomic_store(&writer_quit, true);
+  pthread_join(writer_tid, NULL);
+  fclose(trace_fp);
+  tracing = false;
+}
+
+static void print_record(const trace_record *r) {
+  char text[DISASM_SIZE];
+
+  disassemble(r->opcode, text, sizeof(text));
+  printf("%10u %03X: %04X  %-20s I=%03X", r->cycle, r->pc, r->opcode, text, r->I);
+
+  for(int i=0; i<16; i++)
+    if(r->changed & (1 << i))
+      printf(" V%X=%02X", i, r->V[i]);
+
+  if(r->status != CHIP8_OK)
+    printf(" status=%u", r->status);
+  putchar('\n');
+}
+
+bool decode_trace(const char *path) {
+  const trace_header *header;
+  const trace_record *records;
+  struct stat st;
+  void *map;
+  size_t n;
+  int fd;
+
+  if((fd = open(path, O_RDONLY)) < 0) {
+    fprintf(stderr, "%s: file not found\n", path);
+    return false;
+  }
+
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(trace_header)
+     || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    close(fd);
+    return false;
+  }
+  close(fd);
+
+  header = map;
+  if(memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0
+     || header->version != TRACE_VERSION || header->record_size != sizeof(trace_record)) {
+    fprintf(stderr, "%s: not a trace of this version\n", path);
+    munmap(map, st.st_size);
+    return false;
+  }
+
+  records = (const trace_record *)(header + 1);
+  n = (st.st_size - sizeof(trace_header)) / sizeof(trace_record);
+  for(size_t i=0; i<n; i++)
+    print_record(&records[i]);
+
+  munmap(map, st.st_size);
+
+  return true;
+}
@@ -0,0 +1,47 @@
+#ifndef _CHIP8_TRACE_H_
+#define _CHIP8_TRACE_H_
+
+  #include <stdint.h>
+  #include <stdbool.h>
+  #include "chip8.h"
+
+  /* One executed instruction, as stored in a trace file */
+  typedef struct {
+    uint32_t cycle;       /* cycle_count before the instruction */
+    uint16_t pc;
+    uint16_t opcode;
+    uint16_t I;           /* After the instruction, like everything below */
+    uint16_t changed;     /* Bit n set when the instruction changed Vn */
+    uint8_t V[16];
+    uint8_t sp;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t status;       /* What the engine returned */
+  } trace_record;
+
+  /* Only instructions in both ranges, bounds included, are recorded */
+  typedef struct {
+    uint32_t first_cycle;
+    uint32_t last_cycle;
+    uint16_t first_pc;
+    uint16_t last_pc;
+  } trace_filter;
+
+  /* Record everything */
+  void init_trace_filter(trace_filter *filter);
+
+  /* Create the trace file and start the writer thread. Returns an engine
+  * running engine one instruction at a time and recording each one, or NULL
+  * if the file can't be created.
+  */
+  chip8_engine init_trace(chip8_engine engine, const char *path, const trace_filter *filter);
+
+  /* Write out what is still queued, stop the writer thread and close the file */
+  void free_trace(void);
+
+  /* Print a trace file as text with the debugger mnemonics, false if it
+  * isn't one.
+  */
+  bool decode_trace(const char *path);
+
+#endif
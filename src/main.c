@@ -1,13 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
 #include "chip8.h"
-
-#ifdef DEBUG
-  #include "chip8_dbg.h"
-#endif
+#include "chip8_headless.h"
+#include "chip8_farm.h"
+#include "chip8_sched.h"
+#include "chip8_tbuf.h"
+#include "chip8_dbg.h"
+#include "chip8_state.h"
+#include "chip8_rewind.h"
+#include "chip8_movie.h"
+#include "chip8_trace.h"
+#include "chip8_prof.h"
+#include "chip8_check.h"
+#include "chip8_lib.h"
+#include "chip8_cfg.h"
 
 #define L_WIDTH 1024
 #define L_HEIGHT 512
@@ -15,41 +28,339 @@
 #define M_PI        3.14159265358979323846
 #define AMPLITUDE   28000
 #define SAMPLE_RATE 44100
+#define TONE_HZ     441
+#define WAVE_BITS   8       /* The wavetable holds 2^WAVE_BITS samples of one period */
+
+#define DEFAULT_REWIND_MB 4
+
+#define WINDOW_TITLE "CHIP-8 Emulator"
+
+/* Defaults of --check */
+#define CHECK_CYCLES 1000000
+#define CHECK_INTERVAL 1000
 
 SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
 SDL_Texture *texture = NULL;
 SDL_Event event;
 
+/* Owned by the emulation thread once it is started */
+chip8_t chip8;
+static rewind_buffer history;
+static chip8_movie movie;
+
+/* Shared between the SDL thread and the emulation thread */
+static frame_buffer frames;
+static _Atomic uint16_t keypad;       /* Bit n set while key n is held */
+static atomic_int request;            /* Hotkey action for the emulation thread */
+static atomic_bool sound_on;         /* Read by the audio callback */
+static atomic_bool rewinding;         /* Backspace is held */
+static atomic_bool turbo;             /* Run frames back to back, toggled by Tab */
+static atomic_uint turbo_speed;       /* Last measured turbo speed in percent, 0 when off */
+static atomic_bool wake_pending;      /* A wake-up event is queued for the SDL thread */
+static atomic_bool emu_quit;
+static atomic_bool emu_done;
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;   /* Input for a parked emulation thread */
+
+/* Hotkey actions, carried out by the emulation thread between frames */
+enum {
+  REQ_NONE = 0,
+  REQ_RESET,
+  REQ_SAVE_STATE,
+  REQ_LOAD_STATE
+};
+
+typedef struct {
+  chip8_engine engine;
+  uint32_t ipf;
+  const char *state_file;   /* Written by F5 and read by F9 */
+  bool debug;       /* Post a snapshot for the ncurses debugger every frame */
+  bool rewind;      /* Record every frame into history */
+  bool record;      /* Log the keypad of every frame into movie */
+  int status;       /* Why the emulation thread stopped */
+} emu_thread;
+
+void *emu_main(void *arg);
 void setup_graphics(void);
 void key_down(SDL_Event *event);
 void key_up(SDL_Event *event);
 void setup_audio(void);
-void update_screen(void);
+void set_key(uint8_t key, bool pressed);
+void update_screen(const chip8_frame *frame);
 void destroy_emu(void);
+void show_speed(uint32_t percent);
+char *find_library_rom(const char *dir, const char *rom);
+uint32_t library_ipf(const char *dir, const char *rom, uint32_t ipf);
+static void wake_emu(void);
+
+void usage(const char *prog) {
+  printf("Usage: %s [options] rom_file\n", prog);
+  printf("       %s --library DIR\n", prog);
+  printf("       %s --disasm FORMAT file...\n", prog);
+  printf("       %s --check ENGINE [options] [file...]\n", prog);
+  printf("  --headless    run without SDL or ncurses and print the final state\n");
+  printf("  --debug       show registers and recent instructions in the terminal\n");
+  printf("  --cycles N    stop a headless run after N instructions\n");
+  printf("  --frames N    stop a headless run after N frames of 1/60 s\n");
+  printf("  --ipf N       instructions run per 60 Hz frame (default: %d)\n", DEFAULT_IPF);
+  printf("  --no-idle-skip run every turn of delay timer and key wait loops\n");
+  printf("  --seed N      seed of the CXNN random numbers (default: current time)\n");
+  printf("  --state FILE  save state file of the F5 (save) and F9 (load) keys\n");
+  printf("              (default: rom_file.state)\n");
+  printf("  --load-state FILE  start from a save state, rom_file may then be left out\n");
+  printf("  --save-state FILE  save the machine to FILE when the run ends\n");
+  printf("  --rewind-mb N memory kept for rewinding with Backspace, 0 turns it off\n");
+  printf("              (default: %d)\n", DEFAULT_REWIND_MB);
+  printf("  --turbo       start in turbo mode, Tab switches it on and off\n");
+  printf("  --record FILE save the keys pressed during the run as a movie\n");
+  printf("  --replay FILE run a movie headlessly, with its seed and --ipf\n");
+  printf("  --trace FILE  write every instruction run to a binary trace\n");
+  printf("  --trace-cycles A:B  only trace cycles A to B\n");
+  printf("  --trace-pc A:B      only trace instructions at hex addresses A to B\n");
+  printf("  --decode-trace FILE print a trace as text, in place of rom_file\n");
+  printf("  --profile FILE count instructions by opcode and address, print a report\n");
+  printf("              at exit and write it as JSON to FILE\n");
+  printf("  --check ENGINE run ENGINE in lockstep with the switch engine on every file,\n");
+  printf("              ROM or save state, and on --random programs, for --cycles\n");
+  printf("              instructions each (default: %d)\n", CHECK_CYCLES);
+  printf("  --interval N  instructions between two --check comparisons (default: %d)\n", CHECK_INTERVAL);
+  printf("  --random N    number of random programs --check generates (default: 0)\n");
+  printf("  --farm FILE   run every job of FILE headlessly, in place of rom_file\n");
+  printf("  --threads N   number of --farm worker threads (default: one per CPU)\n");
+  printf("  --engine NAME execution engine: switch (default), cached or jit\n");
+  printf("  --disasm FORMAT disassemble every file and print its control flow graph\n");
+  printf("              as text, dot (Graphviz) or json\n");
+  printf("  --library DIR index the ROMs of DIR when rom_file is left out, otherwise\n");
+  printf("              find rom_file in DIR and use the settings recommended for it\n");
+  exit(10);
+}
 
 int main(int argc, char *argv[]) {
   bool quit = false;
+  uint32_t title_speed = 0;
+  int status = CHIP8_OK;
+  bool headless = false, debug = false;
+  uint64_t max_cycles = 0, max_frames = 0;
+  const char *rom = NULL, *jobs = NULL, *library = NULL;
+  char *library_rom = NULL;
+  const char *state_file = NULL, *load_file = NULL, *save_file = NULL;
+  const char *record_file = NULL, *replay_file = NULL;
+  const char *trace_file = NULL, *decode_file = NULL, *profile_file = NULL;
+  trace_filter filter;
+  char *default_state = NULL;
+  int threads = 0;
+  const char **files = calloc(argc, sizeof(char *));
+  int n_files = 0;
+  chip8_engine check_engine = NULL;
+  uint32_t interval = CHECK_INTERVAL, n_random = 0;
+  int disasm_format = -1;
+  uint32_t ipf = DEFAULT_IPF;
+  bool ipf_set = false;
+  uint32_t rewind_mb = DEFAULT_REWIND_MB;
+  uint32_t seed = (uint32_t)time(NULL);
+  chip8_engine engine = run_switch;
+  emu_thread emu;
+  pthread_t emu_tid;
+
+  init_trace_filter(&filter);
+
+  for(int i=1; i<argc; i++) {
+    if(strcmp(argv[i], "--headless") == 0)
+      headless = true;
+    else if(strcmp(argv[i], "--debug") == 0)
+      debug = true;
+    else if(strcmp(argv[i], "--cycles") == 0 && i+1 < argc)
+      max_cycles = strtoull(argv[++i], NULL, 10);
+    else if(strcmp(argv[i], "--frames") == 0 && i+1 < argc)
+      max_frames = strtoull(argv[++i], NULL, 10);
+    else if(strcmp(argv[i], "--ipf") == 0 && i+1 < argc) {
+      if((ipf = (uint32_t)strtoul(argv[++i], NULL, 10)) == 0)
+        usage(argv[0]);
+      ipf_set = true;
+    }
+    else if(strcmp(argv[i], "--no-idle-skip") == 0)
+      enable_idle_skip(false);
+    else if(strcmp(argv[i], "--seed") == 0 && i+1 < argc)
+      seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+    else if(strcmp(argv[i], "--state") == 0 && i+1 < argc)
+      state_file = argv[++i];
+    else if(strcmp(argv[i], "--load-state") == 0 && i+1 < argc)
+      load_file = argv[++i];
+    else if(strcmp(argv[i], "--save-state") == 0 && i+1 < argc)
+      save_file = argv[++i];
+    else if(strcmp(argv[i], "--rewind-mb") == 0 && i+1 < argc)
+      rewind_mb = (uint32_t)strtoul(argv[++i], NULL, 10);
+    else if(strcmp(argv[i], "--turbo") == 0)
+      atomic_store(&turbo, true);
+    else if(strcmp(argv[i], "--record") == 0 && i+1 < argc)
+      record_file = argv[++i];
+    else if(strcmp(argv[i], "--replay") == 0 && i+1 < argc)
+      replay_file = argv[++i];
+    else if(strcmp(argv[i], "--trace") == 0 && i+1 < argc)
+      trace_file = argv[++i];
+    else if(strcmp(argv[i], "--trace-cycles") == 0 && i+1 < argc) {
+      if(sscanf(argv[++i], "%u:%u", &filter.first_cycle, &filter.last_cycle) != 2)
+        usage(argv[0]);
+    }
+    else if(strcmp(argv[i], "--trace-pc") == 0 && i+1 < argc) {
+      if(sscanf(argv[++i], "%hx:%hx", &filter.first_pc, &filter.last_pc) != 2)
+        usage(argv[0]);
+    }
+    else if(strcmp(argv[i], "--decode-trace") == 0 && i+1 < argc)
+      decode_file = argv[++i];
+    else if(strcmp(argv[i], "--profile") == 0 && i+1 < argc)
+      profile_file = argv[++i];
+    else if(strcmp(argv[i], "--check") == 0 && i+1 < argc) {
+      if((check_engine = find_engine(argv[++i])) == NULL)
+        usage(argv[0]);
+    }
+    else if(strcmp(argv[i], "--interval") == 0 && i+1 < argc) {
+      if((interval = (uint32_t)strtoul(argv[++i], NULL, 10)) == 0)
+        usage(argv[0]);
+    }
+    else if(strcmp(argv[i], "--random") == 0 && i+1 < argc)
+      n_random = (uint32_t)strtoul(argv[++i], NULL, 10);
+    else if(strcmp(argv[i], "--farm") == 0 && i+1 < argc)
+      jobs = argv[++i];
+    else if(strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+      threads = atoi(argv[++i]);
+    else if(strcmp(argv[i], "--disasm") == 0 && i+1 < argc) {
+      if((disasm_format = find_cfg_format(argv[++i])) < 0)
+        usage(argv[0]);
+    }
+    else if(strcmp(argv[i], "--library") == 0 && i+1 < argc)
+      library = argv[++i];
+    else if(strcmp(argv[i], "--engine") == 0 && i+1 < argc) {
+      if((engine = find_engine(argv[++i])) == NULL)
+        usage(argv[0]);
+    }
+    else if(argv[i][0] != '-')
+      files[n_files++] = argv[i];
+    else
+      usage(argv[0]);
+  }
+
+  if(check_engine != NULL) {
+    check_options opt = {max_cycles ? max_cycles : CHECK_CYCLES, interval, ipf, seed};
 
-  if(argc != 2) {
-    printf("Usage: %s rom_file\n", argv[0]);
-    exit(10);
+    printf("Seed: %u\n", seed);
+    return run_check(check_engine, files, n_files, n_random, &opt);
   }
 
-  init_chip8();
+  if(disasm_format >= 0) {
+    if(n_files == 0)
+      usage(argv[0]);
+    return run_disasm(files, n_files, disasm_format);
+  }
+
+  /* Only --check and --disasm take more than one file */
+  if(n_files > 1)
+    usage(argv[0]);
+  rom = files[0];
+
+  if(decode_file != NULL)
+    return decode_trace(decode_file) ? 0 : 1;
+
+  if(jobs != NULL)
+    return run_farm(jobs, threads, engine, ipf, seed, ipf_set ? NULL : library);
 
-  load_rom(argv[argc-1]);
+  if(library != NULL && rom == NULL && load_file == NULL)
+    return scan_library(library) ? 0 : 7;
+
+  if(rom == NULL && load_file == NULL)
+    usage(argv[0]);
+
+  if(library != NULL && rom != NULL) {
+    rom = library_rom = find_library_rom(library, rom);
+    if(!ipf_set)
+      ipf = library_ipf(library, rom, ipf);
+  }
 
-  init_debug();
+  /* A movie replays headlessly, with the seed and frame length it was recorded with */
+  if(replay_file != NULL) {
+    if(record_file != NULL)
+      usage(argv[0]);
+    if(!read_movie(&movie, replay_file))
+      return 4;
+    seed = movie.seed;
+    ipf = movie.ipf;
+    headless = true;
+    if(max_cycles == 0 && max_frames == 0)
+      max_frames = movie.frames;
+  }
+
+  /* A headless run needs a limit, otherwise it would never finish */
+  if(headless && ((max_cycles == 0 && max_frames == 0) || record_file != NULL))
+    usage(argv[0]);
+
+  init_chip8(&chip8);
+
+  seed_chip8(&chip8, seed);
+  if(rom != NULL)
+    load_rom(&chip8, rom);
+  if(load_file != NULL && !read_state_file(&chip8, load_file))
+    return 2;
+
+  /* The tracer, profiler and debugger see every instruction, skipped ones too */
+  if(trace_file != NULL || profile_file != NULL || debug)
+    enable_idle_skip(false);
+  if(trace_file != NULL && (engine = init_trace(engine, trace_file, &filter)) == NULL)
+    return 5;
+  if(profile_file != NULL)
+    engine = init_profile(engine);
+
+  if(headless) {
+    printf("Seed: %u\n", seed);
+    status = run_headless(&chip8, engine, ipf, max_cycles, max_frames,
+                          replay_file != NULL ? &movie : NULL);
+    free_movie(&movie);
+    free_trace();
+    if(profile_file != NULL && !write_profile(&chip8, profile_file))
+      return 6;
+    if(save_file != NULL && !write_state_file(&chip8, save_file))
+      return 3;
+    return status == CHIP8_EXIT ? 0 : status;
+  }
+
+  if(state_file == NULL) {
+    const char *base = rom != NULL ? rom : load_file;
+
+    default_state = malloc(strlen(base) + sizeof(".state"));
+    strcpy(default_state, base);
+    strcat(default_state, ".state");
+    state_file = default_state;
+  }
+
+  /* Going back in time would make the movie disagree with the run */
+  if(record_file != NULL) {
+    init_movie(&movie, seed, ipf);
+    rewind_mb = 0;
+  }
+
+  if(rewind_mb > 0 && !init_rewind(&history, (size_t)rewind_mb << 20)) {
+    printf("Could not allocate %u MB of rewind history\n", rewind_mb);
+    rewind_mb = 0;
+  }
+
+  if(debug)
+    engine = init_debug(engine);
   setup_graphics();
   setup_audio();
 
-  // Main loop
-  while(!quit) {
-    emulate_cycle();
-    cpu_debugger();
-
-    while(SDL_PollEvent(&event)) {
+  init_frame_buffer(&frames);
+  emu.engine = engine;
+  emu.ipf = ipf;
+  emu.state_file = state_file;
+  emu.debug = debug;
+  emu.rewind = rewind_mb > 0;
+  emu.record = record_file != NULL;
+  emu.status = CHIP8_OK;
+  pthread_create(&emu_tid, NULL, emu_main, &emu);
+
+  /* SDL loop: sleeps until input arrives or the emulation thread has something to show */
+  while(!quit && SDL_WaitEvent(&event)) {
+    do {
       if(event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE))
         quit = true;
       else
@@ -58,23 +369,261 @@ int main(int argc, char *argv[]) {
         else
           if(event.type == SDL_KEYUP)
             key_up(&event);
+          else
+            if(event.type == SDL_USEREVENT)
+              atomic_store(&wake_pending, false);
+    } while(SDL_PollEvent(&event));
+
+    wake_emu();
+
+    if(consume_frame(&frames))
+      update_screen(frame_front(&frames));
+
+    if(atomic_load(&turbo_speed) != title_speed) {
+      title_speed = atomic_load(&turbo_speed);
+      show_speed(title_speed);
+    }
+
+    if(atomic_load(&emu_done))
+      break;
+  }
+
+  atomic_store(&emu_quit, true);
+  wake_emu();
+  pthread_join(emu_tid, NULL);
+  status = emu.status;
+
+  destroy_emu();
+  if(debug)
+    free_debug();
+  free_trace();
+  free_jit(&chip8);
+  if(emu.rewind)
+    free_rewind(&history);
+
+  if(save_file != NULL)
+    write_state_file(&chip8, save_file);
+  if(record_file != NULL) {
+    write_movie(&movie, record_file);
+    free_movie(&movie);
+  }
+  free(default_state);
+  free(library_rom);
+
+  if(profile_file != NULL)
+    write_profile(&chip8, profile_file);
+  print_status(&chip8, status);
+
+  /* A ROM that ran 00FD ended normally */
+  return status == CHIP8_EXIT ? 0 : status;
+}
+
+/* rom as given when it exists, otherwise the file of that name in the library */
+char *find_library_rom(const char *dir, const char *rom) {
+  FILE *fp = NULL;
+  char *path;
+
+  /* Only a bare file name that isn't in the current directory is looked up */
+  if(strchr(rom, '/') == NULL && (fp = fopen(rom, "rb")) == NULL) {
+    path = malloc(strlen(dir) + strlen(rom) + 2);
+    sprintf(path, "%s/%s", dir, rom);
+  } else {
+    path = malloc(strlen(rom) + 1);
+    strcpy(path, rom);
+  }
+
+  if(fp != NULL)
+    fclose(fp);
+
+  return path;
+}
+
+/* The ipf recommended by the library index for rom, ipf if it isn't indexed */
+uint32_t library_ipf(const char *dir, const char *rom, uint32_t ipf) {
+  const lib_entry *e;
+  rom_library lib;
+  mapped_file image;
+
+  if(!open_library(dir, &lib)) {
+    printf("No library index in %s, run --library %s first\n", dir, dir);
+    return ipf;
+  }
+
+  if(map_file(rom, &image)) {
+    if((e = find_rom(&lib, image.data, image.size)) != NULL) {
+      printf("Library: %s, %s, %u instructions per frame\n", e->name, platform_name(e->platform), e->ipf);
+      ipf = e->ipf;
+    } else
+      printf("Library: %s is not indexed in %s\n", rom, dir);
+    unmap_file(&image);
+  }
+  close_library(&lib);
+
+  return ipf;
+}
+
+/* Show the turbo speed in the title bar, or the plain title when it's off */
+void show_speed(uint32_t percent) {
+  char title[64];
+
+  if(percent == 0)
+    SDL_SetWindowTitle(window, WINDOW_TITLE);
+  else {
+    snprintf(title, sizeof(title), "%s - turbo %u.%ux", WINDOW_TITLE, percent / 100, percent / 10 % 10);
+    SDL_SetWindowTitle(window, title);
+  }
+}
+
+/* Queue an event so the SDL thread looks at the frame buffer */
+static void wake_display(void) {
+  SDL_Event wake;
+
+  if(atomic_exchange(&wake_pending, true))
+    return;
+
+  memset(&wake, 0, sizeof(wake));
+  wake.type = SDL_USEREVENT;
+  SDL_PushEvent(&wake);
+}
+
+/* Tell a parked emulation thread to look at the keypad, requests and quit flag again */
+static void wake_emu(void) {
+  pthread_mutex_lock(&park_lock);
+  pthread_cond_signal(&park_cond);
+  pthread_mutex_unlock(&park_lock);
+}
+
+/* Sleep until the SDL thread changes something the emulation thread reads */
+static void park_emu(uint16_t keys) {
+  pthread_mutex_lock(&park_lock);
+  while(atomic_load(&keypad) == keys && atomic_load(&request) == REQ_NONE
+        && !atomic_load(&rewinding) && !atomic_load(&emu_quit))
+    pthread_cond_wait(&park_cond, &park_lock);
+  pthread_mutex_unlock(&park_lock);
+}
+
+/* Hand the screen over to the SDL thread, rows drawn so far go with it */
+static void send_frame(void) {
+  chip8_frame *frame = frame_back(&frames);
+
+  memcpy(frame->gfx, chip8.gfx, sizeof(frame->gfx));
+  frame->dirty_rows = chip8.dirty_rows;
+  frame->hires = chip8.cpu.hires;
+  chip8.dirty_rows = 0;
+  publish_frame(&frames);
+}
+
+/* Emulation thread: one frame of instructions, then sleep until the next is due.
+* Rendering never holds it up, finished frames go through the triple buffer.
+*/
+void *emu_main(void *arg) {
+  emu_thread *emu = arg;
+  frame_clock pacing;
+  speed_meter meter;
+  uint64_t frame = 0;
+  bool fast = false;
+
+  init_frame_clock(&pacing);
+
+  while(!atomic_load(&emu_quit)) {
+    uint16_t keys = atomic_load(&keypad);
+    bool sound, wake = false;
+
+    /* Turbo runs frames back to back, timers still tick once per frame */
+    if(atomic_load(&turbo) != fast) {
+      fast = !fast;
+      if(fast)
+        init_speed_meter(&meter);
+      else {
+        atomic_store(&turbo_speed, 0);
+        init_frame_clock(&pacing);
+        wake = true;
+      }
+    }
+
+    for(int i=0; i<16; i++)
+      chip8.keys[i] = (keys >> i) & 1;
+
+    switch(atomic_exchange(&request, REQ_NONE)) {
+      case REQ_RESET:
+        if(!emu->record)
+          reset_chip8(&chip8);
+        break;
+      case REQ_SAVE_STATE:
+        write_state_file(&chip8, emu->state_file);
+        break;
+      case REQ_LOAD_STATE:
+        if(!emu->record)
+          read_state_file(&chip8, emu->state_file);
+        break;
     }
 
-    if(cpu.draw_flag) {
-      cpu.draw_flag = false;
+    /* While rewinding, each frame steps one recorded frame back in time */
+    if(emu->rewind && atomic_load(&rewinding))
+      rewind_step(&history, &chip8);
+    else {
+      if(emu->record)
+        record_keys(&movie, frame, keys);
+      frame++;
+      if((emu->status = run_frame(&chip8, emu->engine, emu->ipf)) != CHIP8_OK)
+        break;
+      if(emu->rewind)
+        rewind_capture(&history, &chip8);
+    }
+
+    if(emu->debug)
+      post_snapshot(&chip8);
 
-      update_screen();
+    /* In turbo, screens go out no faster than the host shows them, rows drawn
+    * in between stay dirty for the next one
+    */
+    if(chip8.cpu.draw_flag && (!fast || frame_due(&pacing))) {
+      chip8.cpu.draw_flag = false;
+      send_frame();
+      wake = true;
     }
 
-    SDL_PauseAudio(!cpu.sound_timer);
+    /* Only transitions are stored, the audio callback reads the flag itself */
+    sound = chip8.cpu.sound_timer > 0;
+    if(sound != atomic_load_explicit(&sound_on, memory_order_relaxed))
+      atomic_store_explicit(&sound_on, sound, memory_order_relaxed);
+
+    if(fast) {
+      uint32_t speed = count_frame(&meter);
 
-    cpu.cycle_count++;
+      if(speed != 0) {
+        atomic_store(&turbo_speed, speed);
+        wake = true;
+      }
+    }
+
+    if(wake)
+      wake_display();
+
+    /* A ROM on FX0A with both timers run out does nothing until a key is
+    * pressed, so rather than spinning through empty frames the thread sleeps.
+    * The frames it slept through are counted as run, as they would have been.
+    */
+    if(!atomic_load(&rewinding) && waiting_for_key(&chip8)
+       && chip8.cpu.delay_timer == 0 && chip8.cpu.sound_timer == 0) {
+      uint64_t idle;
+
+      park_emu(keys);
+      if(atomic_load(&emu_quit))
+        break;
+      idle = resume_frame_clock(&pacing);
+      chip8.cpu.cycle_count += (uint32_t)(idle * emu->ipf);
+      frame += idle;
+    }
+    else
+      if(!fast)
+        wait_frame(&pacing);
   }
 
-  destroy_emu();
-  free_debug();
+  atomic_store(&emu_done, true);
+  wake_display();
 
-  return 0;
+  return NULL;
 }
 
 void setup_graphics(void) {
@@ -83,7 +632,7 @@ void setup_graphics(void) {
     exit(11);
   }
 
-  window = SDL_CreateWindow("CHIP-8 Emulator",
+  window = SDL_CreateWindow(WINDOW_TITLE,
                             SDL_WINDOWPOS_UNDEFINED,
                             SDL_WINDOWPOS_UNDEFINED,
                             L_WIDTH, L_HEIGHT,
@@ -96,133 +645,166 @@ void setup_graphics(void) {
   renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
   SDL_RenderSetLogicalSize(renderer, L_WIDTH, L_HEIGHT);
 
-  texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 64, 32);
+  texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
 }
 
 void key_down(SDL_Event *event) {
   switch(event->key.keysym.sym) {
     case SDLK_x:
-      keys[0x0] = true;
+      set_key(0x0, true);
       break;
     case SDLK_1:
-      keys[0x1] = true;
+      set_key(0x1, true);
       break;
     case SDLK_2:
-      keys[0x2] = true;
+      set_key(0x2, true);
       break;
     case SDLK_3:
-      keys[0x3] = true;
+      set_key(0x3, true);
       break;
     case SDLK_q:
-      keys[0x4] = true;
+      set_key(0x4, true);
       break;
     case SDLK_w:
-      keys[0x5] = true;
+      set_key(0x5, true);
       break;
     case SDLK_e:
-      keys[0x6] = true;
+      set_key(0x6, true);
       break;
     case SDLK_a:
-      keys[0x7] = true;
+      set_key(0x7, true);
       break;
     case SDLK_s:
-      keys[0x8] = true;
+      set_key(0x8, true);
       break;
     case SDLK_d:
-      keys[0x9] = true;
+      set_key(0x9, true);
       break;
     case SDLK_z:
-      keys[0xA] = true;
+      set_key(0xA, true);
       break;
     case SDLK_c:
-      keys[0xB] = true;
+      set_key(0xB, true);
       break;
     case SDLK_4:
-      keys[0xC] = true;
+      set_key(0xC, true);
       break;
     case SDLK_r:
-      keys[0xD] = true;
+      set_key(0xD, true);
       break;
     case SDLK_f:
-      keys[0xE] = true;
+      set_key(0xE, true);
       break;
     case SDLK_v:
-      keys[0xF] = true;
+      set_key(0xF, true);
       break;
     case SDLK_u:
-      reset_chip8();
+      atomic_store(&request, REQ_RESET);
+      break;
+    case SDLK_F5:
+      atomic_store(&request, REQ_SAVE_STATE);
+      break;
+    case SDLK_F9:
+      atomic_store(&request, REQ_LOAD_STATE);
+      break;
+    case SDLK_BACKSPACE:
+      atomic_store(&rewinding, true);
+      break;
+    case SDLK_TAB:
+      if(!event->key.repeat)
+        atomic_store(&turbo, !atomic_load(&turbo));
   }
 }
 
 void key_up(SDL_Event *event) {
   switch(event->key.keysym.sym) {
     case SDLK_x:
-      keys[0x0] = false;
+      set_key(0x0, false);
       break;
     case SDLK_1:
-      keys[0x1] = false;
+      set_key(0x1, false);
       break;
     case SDLK_2:
-      keys[0x2] = false;
+      set_key(0x2, false);
       break;
     case SDLK_3:
-      keys[0x3] = false;
+      set_key(0x3, false);
       break;
     case SDLK_q:
-      keys[0x4] = false;
+      set_key(0x4, false);
       break;
     case SDLK_w:
-      keys[0x5] = false;
+      set_key(0x5, false);
       break;
     case SDLK_e:
-      keys[0x6] = false;
+      set_key(0x6, false);
       break;
     case SDLK_a:
-      keys[0x7] = false;
+      set_key(0x7, false);
       break;
     case SDLK_s:
-      keys[0x8] = false;
+      set_key(0x8, false);
       break;
     case SDLK_d:
-      keys[0x9] = false;
+      set_key(0x9, false);
       break;
     case SDLK_z:
-      keys[0xA] = false;
+      set_key(0xA, false);
       break;
     case SDLK_c:
-      keys[0xB] = false;
+      set_key(0xB, false);
       break;
     case SDLK_4:
-      keys[0xC] = false;
+      set_key(0xC, false);
       break;
     case SDLK_r:
-      keys[0xD] = false;
+      set_key(0xD, false);
       break;
     case SDLK_f:
-      keys[0xE] = false;
+      set_key(0xE, false);
       break;
     case SDLK_v:
-      keys[0xF] = false;
+      set_key(0xF, false);
       break;
+    case SDLK_BACKSPACE:
+      atomic_store(&rewinding, false);
   }
 }
 
-/* SDL Audio Callback */
+void set_key(uint8_t key, bool pressed) {
+  if(pressed)
+    atomic_fetch_or(&keypad, 1 << key);
+  else
+    atomic_fetch_and(&keypad, ~(1 << key));
+}
+
+/* Tone of the beeper and where the callback is in it, kept while the device is open */
+typedef struct {
+  int16_t wave[1 << WAVE_BITS];
+  uint32_t phase;     /* A whole period is 2^32 */
+  uint32_t step;      /* Phase advance per sample */
+} beeper;
+
+static beeper tone;
+
+/* SDL Audio Callback: the device plays all the time, silence while the sound timer is off */
 void audio_callback(void *user_data, uint8_t *raw_buffer, int bytes) {
+  beeper *b = user_data;
   int16_t *buffer = (int16_t *)raw_buffer;
   int length = bytes / 2;  /* 2 bytes per sample for AUDIO_S16SYS */
-  int sample_nr = (*(int *)user_data);
 
-  for(int i=0; i<length; i++,sample_nr++) {
-    double time = (double)sample_nr / (double)SAMPLE_RATE;
+  if(!atomic_load_explicit(&sound_on, memory_order_relaxed)) {
+    memset(raw_buffer, 0, bytes);
+    return;
+  }
 
-    /* Render 441 HZ sine wave */
-    buffer[i] = (int16_t)(AMPLITUDE * sin(2.0f * M_PI * 441.0f * time));
+  for(int i=0; i<length; i++) {
+    buffer[i] = b->wave[b->phase >> (32 - WAVE_BITS)];
+    b->phase += b->step;
   }
 }
 
 void setup_audio(void) {
-  int sample_nr = 0;
   SDL_AudioSpec want;
   SDL_AudioSpec have;
 
@@ -241,25 +823,93 @@ void setup_audio(void) {
   /* Function SDL calls periodically to refill the buffer */
   want.callback = audio_callback;
 
-  /* Counter, keeping track of current sample number */
-  want.userdata = &sample_nr;
+  /* Wavetable and phase, which outlive this function */
+  want.userdata = &tone;
 
-  if(SDL_OpenAudio(&want, &have) != 0)
+  /* One period of a sine wave, computed once */
+  for(int i=0; i<(1 << WAVE_BITS); i++)
+    tone.wave[i] = (int16_t)(AMPLITUDE * sin(2.0 * M_PI * i / (1 << WAVE_BITS)));
+  tone.phase = 0;
+
+  if(SDL_OpenAudio(&want, &have) != 0) {
     printf("Could not open audio: %s.\n", SDL_GetError());
+    return;
+  }
 
-  if(want.format != have.format)
+  if(want.format != have.format) {
     printf("Could not get desired audio spec.\n");
+    SDL_CloseAudio();
+    return;
+  }
+
+  tone.step = (uint32_t)(((uint64_t)TONE_HZ << 32) / (uint64_t)have.freq);
+  SDL_PauseAudio(0);
 }
 
-void update_screen(void) {
-  uint32_t pixels[2048];
+/* Rows as last uploaded to the texture, and the frame they came from */
+static uint64_t shown[HIRES_HEIGHT][ROW_WORDS];
+static uint32_t shown_seq;
+static bool shown_valid = false;
+static bool shown_hires = false;    /* Resolution of the texture */
+
+/* Upload the rectangle of pixels that differ from what is on screen, and present
+* only if there is one: a sprite erased and drawn again at the same place costs nothing.
+* A change of resolution recreates the texture at the new size and uploads it whole.
+*/
+void update_screen(const chip8_frame *frame) {
+  int width = frame->hires ? HIRES_WIDTH : SCREEN_WIDTH, height = frame->hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+  uint32_t pixels[HIRES_WIDTH * HIRES_HEIGHT];
+  uint64_t changed[ROW_WORDS] = {0};
+  int top = height, bottom = -1, left = 0, right = width - 1;
+  bool all_rows;
+  SDL_Rect rect;
+
+  if(frame->hires != shown_hires) {
+    SDL_DestroyTexture(texture);
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+    shown_hires = frame->hires;
+    shown_valid = false;
+  }
+
+  /* Dirty rows of dropped frames are lost, look at every row then */
+  all_rows = !shown_valid || frame->seq != shown_seq + 1;
+
+  for(int i=0; i<height; i++) {
+    uint64_t diff[ROW_WORDS], any = 0;
 
-  for(int i=0; i<2048; i++) {
-    uint8_t pixel = gfx[i];
-    pixels[i] = (0x00FFFFFF * pixel) | 0xFF000000;
+    for(int w=0; w<ROW_WORDS; w++)
+      any |= diff[w] = frame->gfx[i][w] ^ shown[i][w];
+
+    if(shown_valid && ((!all_rows && (frame->dirty_rows >> i & 1) == 0) || any == 0))
+      continue;
+
+    for(int w=0; w<ROW_WORDS; w++)
+      changed[w] |= shown_valid ? diff[w] : ~(uint64_t)0;
+    memcpy(shown[i], frame->gfx[i], sizeof(shown[i]));
+    if(top == height)
+      top = i;
+    bottom = i;
   }
 
-  SDL_UpdateTexture(texture, NULL, pixels, 64 * sizeof(uint32_t));
+  shown_seq = frame->seq;
+  shown_valid = true;
+
+  if(bottom < 0)
+    return;
+
+  /* Bit 63 of each word is its leftmost column */
+  while(!(changed[left / 64] >> (63 - left % 64) & 1))
+    left++;
+  while(!(changed[right / 64] >> (63 - right % 64) & 1))
+    right--;
+
+  expand_gfx(frame->gfx, pixels, width, top, bottom - top + 1, 0xFFFFFFFF, 0xFF000000);
+
+  rect.x = left;
+  rect.y = top;
+  rect.w = right - left + 1;
+  rect.h = bottom - top + 1;
+  SDL_UpdateTexture(texture, &rect, pixels + left, width * sizeof(uint32_t));
 
   SDL_RenderClear(renderer);
   SDL_RenderCopy(renderer, texture, NULL, NULL);